@@ -44,6 +44,9 @@
 #include <linux/slab.h>
 #include <linux/input/mt.h>
 #include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
 
 
 MODULE_AUTHOR("Stephane Chatty <chatty@enac.fr>");
@@ -68,16 +71,84 @@ MODULE_LICENSE("GPL");
 #define MT_QUIRK_CONTACT_CNT_ACCURATE	(1 << 12)
 #define MT_QUIRK_FORCE_GET_FEATURE	(1 << 13)
 
+/* quirks mt_complete_slot() looks at, see mt_select_handlers() */
+#define MT_SLOT_QUIRKS	(MT_QUIRK_SLOT_IS_CONTACTID |		\
+			 MT_QUIRK_CYPRESS |			\
+			 MT_QUIRK_SLOT_IS_CONTACTNUMBER |	\
+			 MT_QUIRK_SLOT_IS_CONTACTID_MINUS_ONE |	\
+			 MT_QUIRK_ALWAYS_VALID |		\
+			 MT_QUIRK_IGNORE_DUPLICATES |		\
+			 MT_QUIRK_CONTACT_CNT_ACCURATE)
+
 #define MT_INPUTMODE_TOUCHSCREEN	0x02
 #define MT_INPUTMODE_TOUCHPAD		0x03
 
 #define MT_BUTTONTYPE_CLICKPAD		0
 
+/* feature transfers pending in mt_device.config */
+#define MT_CONFIG_FEATURES	0	/* InputMode and Contact Count Maximum */
+#define MT_CONFIG_REPROGRAM	1	/* the device lost them, send them again */
+#define MT_CONFIG_IDLE		2	/* SET_IDLE */
+
 struct mt_slot {
 	__s32 x, y, cx, cy, p, w, h;
 	__s32 contactid;	/* the device ContactID assigned to this slot */
-	bool touch_state;	/* is the touch valid? */
-	bool inrange_state;	/* is the finger in proximity of the sensor? */
+	__s32 touch_state;	/* is the touch valid? */
+	__s32 inrange_state;	/* is the finger in proximity of the sensor? */
+};
+
+/* axes reported for each contact */
+enum {
+	MT_AXIS_X,
+	MT_AXIS_Y,
+	MT_AXIS_TOOL_X,
+	MT_AXIS_TOOL_Y,
+	MT_AXIS_DISTANCE,
+	MT_AXIS_ORIENTATION,
+	MT_AXIS_PRESSURE,
+	MT_AXIS_MAJOR,
+	MT_AXIS_MINOR,
+	MT_SLOT_AXES
+};
+
+static const __u16 mt_slot_axes[MT_SLOT_AXES] = {
+	[MT_AXIS_X] = ABS_MT_POSITION_X,
+	[MT_AXIS_Y] = ABS_MT_POSITION_Y,
+	[MT_AXIS_TOOL_X] = ABS_MT_TOOL_X,
+	[MT_AXIS_TOOL_Y] = ABS_MT_TOOL_Y,
+	[MT_AXIS_DISTANCE] = ABS_MT_DISTANCE,
+	[MT_AXIS_ORIENTATION] = ABS_MT_ORIENTATION,
+	[MT_AXIS_PRESSURE] = ABS_MT_PRESSURE,
+	[MT_AXIS_MAJOR] = ABS_MT_TOUCH_MAJOR,
+	[MT_AXIS_MINOR] = ABS_MT_TOUCH_MINOR,
+};
+
+/* what was last sent to the input core for a slot */
+struct mt_emitted {
+	__s32 axis[MT_SLOT_AXES];	/* indexed by MT_AXIS_*, before defuzzing */
+	bool active;		/* axis holds the values of a live contact */
+	/* frame coalescing, see mt_sync_frame() */
+	__s32 held[MT_SLOT_AXES];	/* latest values, not sent yet */
+	bool dirty;		/* held is newer than axis */
+	unsigned seen;		/* last frame the slot was reported in */
+};
+
+/* upper bound of the max_frame_rate attribute, in frames per second */
+#define MT_MAX_FRAME_RATE	1000
+
+/*
+ * One step of the multitouch report handler: a value of the report is
+ * either stored where the contact being read keeps it, or forwarded as
+ * an input event. The plan lists the steps in report order and is built
+ * from the mapped usages and the quirks, so that mt_touch_report() does
+ * not look at usages at all.
+ */
+struct mt_plan_entry {
+	const __s32 *value;	/* the value in its report field */
+	__s32 *dest;		/* where to store it, NULL to send it as an event */
+	__u16 code;		/* event code if dest is NULL */
+	__u8 type;		/* event type if dest is NULL, 0 for no event */
+	bool last;		/* the contact is complete after this value */
 };
 
 struct mt_class {
@@ -98,6 +169,7 @@ struct mt_fields {
 };
 
 struct mt_device {
+	struct hid_device *hdev;	/* the device we are bound to */
 	struct mt_slot curdata;	/* placeholder of incoming data */
 	struct mt_class mtclass;	/* our mt device class */
 	struct mt_fields *fields;	/* temporary placeholder for storing the
@@ -105,6 +177,24 @@ struct mt_device {
 	int cc_index;	/* contact count field index in the report */
 	int cc_value_index;	/* contact count value index in the field */
 	unsigned last_slot_field;	/* the last field of a slot */
+	struct hid_report *mt_report;	/* the multitouch report, once configured */
+	struct mt_plan_entry *plan;	/* dispatch plan of mt_report */
+	unsigned plan_length;	/* entries in use in plan */
+	void (*complete_slot)(struct mt_device *td, struct input_dev *input);
+				/* mt_complete_slot() for the quirks in use */
+	struct mt_emitted *emitted;	/* maxcontacts slots last sent */
+	struct work_struct config_work;	/* sends the pending feature reports */
+	unsigned long config;	/* MT_CONFIG_* transfers config_work owes */
+	u8 *inputmode_buf;	/* for the GET_REPORT of the InputMode feature */
+	struct input_dev *input;	/* the multitouch input, once configured */
+	spinlock_t frame_lock;	/* frame reading vs flush_timer */
+	unsigned max_frame_rate;	/* frames published per second, 0 for all */
+	u64 frame_interval;	/* ns between two published frames, 0 for all */
+	u64 published;		/* ktime_get_ns() of the last published frame */
+	unsigned frame;		/* number of the frame being read */
+	bool transition;	/* a contact or button of the frame changed */
+	bool held;		/* frames wait for flush_timer */
+	struct hrtimer flush_timer;	/* publishes held frames */
 	unsigned mt_report_id;	/* the report ID of the multitouch device */
 	__s16 inputmode;	/* InputMode HID feature, -1 if non-existent */
 	__s16 inputmode_index;	/* InputMode HID feature index in the report */
@@ -120,12 +210,14 @@ struct mt_device {
 	__u8 buttons_count;	/* number of physical buttons per touchpad */
 	bool is_buttonpad;	/* is this device a button pad? */
 	bool serial_maybe;	/* need to check for serial protocol */
-	bool curvalid;		/* is the current contact valid? */
+	__s32 curvalid;		/* is the current contact valid? */
 	unsigned mt_flags;	/* flags to pass to input-mt */
 };
 
 static void mt_post_parse_default_settings(struct mt_device *td);
 static void mt_post_parse(struct mt_device *td);
+static void mt_build_plan(struct mt_device *td);
+static void mt_select_handlers(struct mt_device *td);
 
 /* classes of device behavior */
 #define MT_CLS_DEFAULT				0x0001
@@ -268,6 +360,9 @@ static struct mt_class mt_classes[] = {
 	{ }
 };
 
+static void mt_publish_frame(struct mt_device *td, struct input_dev *input,
+		unsigned frame);
+
 static ssize_t mt_show_quirks(struct device *dev,
 			   struct device_attribute *attr,
 			   char *buf)
@@ -290,18 +385,67 @@ static ssize_t mt_set_quirks(struct device *dev,
 	if (kstrtoul(buf, 0, &val))
 		return -EINVAL;
 
+	/* no report is handled while the plan is rebuilt */
+	down(&hdev->driver_input_lock);
 	td->mtclass.quirks = val;
 
 	if (td->cc_index < 0)
 		td->mtclass.quirks &= ~MT_QUIRK_CONTACT_CNT_ACCURATE;
 
+	mt_select_handlers(td);
+	mt_build_plan(td);
+	up(&hdev->driver_input_lock);
+
 	return count;
 }
 
 static DEVICE_ATTR(quirks, S_IWUSR | S_IRUGO, mt_show_quirks, mt_set_quirks);
 
+static ssize_t mt_show_max_frame_rate(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct mt_device *td = hid_get_drvdata(hdev);
+
+	return sprintf(buf, "%u\n", td->max_frame_rate);
+}
+
+static ssize_t mt_set_max_frame_rate(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct mt_device *td = hid_get_drvdata(hdev);
+	unsigned long flags;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || val > MT_MAX_FRAME_RATE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&td->frame_lock, flags);
+	td->max_frame_rate = val;
+	td->frame_interval = val ? NSEC_PER_SEC / val : 0;
+	/*
+	 * what was held back goes out now, or with the frame being read:
+	 * its contacts would be released as unused by a publish in between
+	 */
+	if (!val && td->held && !td->num_received)
+		mt_publish_frame(td, td->input, td->frame - 1);
+	spin_unlock_irqrestore(&td->frame_lock, flags);
+
+	if (!val)
+		hrtimer_cancel(&td->flush_timer);
+
+	return count;
+}
+
+static DEVICE_ATTR(max_frame_rate, S_IWUSR | S_IRUGO, mt_show_max_frame_rate,
+		   mt_set_max_frame_rate);
+
 static struct attribute *sysfs_attrs[] = {
 	&dev_attr_quirks.attr,
+	&dev_attr_max_frame_rate.attr,
 	NULL
 };
 
@@ -568,10 +712,9 @@ static int mt_touch_input_mapped(struct hid_device *hdev, struct hid_input *hi,
 	return -1;
 }
 
-static int mt_compute_slot(struct mt_device *td, struct input_dev *input)
+static __always_inline int mt_compute_slot(struct mt_device *td,
+		struct input_dev *input, __s32 quirks)
 {
-	__s32 quirks = td->mtclass.quirks;
-
 	if (quirks & MT_QUIRK_SLOT_IS_CONTACTID)
 		return td->curdata.contactid;
 
@@ -587,65 +730,276 @@ static int mt_compute_slot(struct mt_device *td, struct input_dev *input)
 	return input_mt_get_slot_by_key(input, td->curdata.contactid);
 }
 
+/*
+ * send the axes of a live contact, skipping the ones the input core would
+ * drop anyway, after taking its event lock for each of them: the axes the
+ * device does not have, and the values the slot already holds. These are
+ * compared after defuzzing, as the core stored them. A new contact sends
+ * all of them.
+ */
+static void mt_emit_slot(struct mt_device *td, struct input_dev *input,
+		int slotnum, const __s32 *axis)
+{
+	struct mt_emitted *e = &td->emitted[slotnum];
+	struct input_mt_slot *slot = &input->mt->slots[slotnum];
+	int i;
+
+	for (i = 0; i < MT_SLOT_AXES; i++) {
+		__u16 code = mt_slot_axes[i];
+
+		e->axis[i] = axis[i];
+		if (!test_bit(code, input->absbit))
+			continue;
+		if (e->active && input_mt_get_value(slot, code) == axis[i])
+			continue;
+		input_event(input, EV_ABS, code, axis[i]);
+	}
+	e->active = true;
+}
+
+static void mt_slot_values(const struct mt_slot *s, __s32 *axis)
+{
+	axis[MT_AXIS_X] = s->x;
+	axis[MT_AXIS_Y] = s->y;
+	axis[MT_AXIS_TOOL_X] = s->cx;
+	axis[MT_AXIS_TOOL_Y] = s->cy;
+	axis[MT_AXIS_DISTANCE] = !s->touch_state;
+	axis[MT_AXIS_ORIENTATION] = s->w > s->h;
+	/* divided by two to match visual scale of touch */
+	axis[MT_AXIS_MAJOR] = max(s->w, s->h) >> 1;
+	axis[MT_AXIS_MINOR] = min(s->w, s->h) >> 1;
+	axis[MT_AXIS_PRESSURE] = s->p;
+}
+
 /*
  * this function is called when a whole contact has been processed,
- * so that it can assign it to a slot and store the data there
+ * so that it can assign it to a slot and store the data there.
+ * It is inlined in one handler per common class, where the quirks are
+ * constants, and in a generic one reading them from td.
  */
-static void mt_complete_slot(struct mt_device *td, struct input_dev *input)
+static __always_inline void __mt_complete_slot(struct mt_device *td,
+		struct input_dev *input, __s32 quirks)
 {
-	if ((td->mtclass.quirks & MT_QUIRK_CONTACT_CNT_ACCURATE) &&
+	if ((quirks & MT_QUIRK_CONTACT_CNT_ACCURATE) &&
 	    td->num_received >= td->num_expected)
 		return;
 
-	if (td->curvalid || (td->mtclass.quirks & MT_QUIRK_ALWAYS_VALID)) {
-		int slotnum = mt_compute_slot(td, input);
+	if (td->curvalid || (quirks & MT_QUIRK_ALWAYS_VALID)) {
+		int slotnum = mt_compute_slot(td, input, quirks);
 		struct mt_slot *s = &td->curdata;
 		struct input_mt *mt = input->mt;
+		struct mt_emitted *e;
+		__s32 axis[MT_SLOT_AXES];
+		/* this finger is in proximity of the sensor */
+		bool active = s->touch_state || s->inrange_state;
 
 		if (slotnum < 0 || slotnum >= td->maxcontacts)
 			return;
+		e = &td->emitted[slotnum];
 
-		if ((td->mtclass.quirks & MT_QUIRK_IGNORE_DUPLICATES) && mt) {
+		if ((quirks & MT_QUIRK_IGNORE_DUPLICATES) && mt) {
 			struct input_mt_slot *slot = &mt->slots[slotnum];
 			if (input_mt_is_active(slot) &&
 			    input_mt_is_used(mt, slot))
 				return;
+			if (td->frame_interval && e->dirty &&
+			    e->seen == td->frame)
+				return;
 		}
 
-		input_mt_slot(input, slotnum);
-		input_mt_report_slot_state(input, MT_TOOL_FINGER,
-			s->touch_state || s->inrange_state);
-		if (s->touch_state || s->inrange_state) {
-			/* this finger is in proximity of the sensor */
-			int wide = (s->w > s->h);
-			/* divided by two to match visual scale of touch */
-			int major = max(s->w, s->h) >> 1;
-			int minor = min(s->w, s->h) >> 1;
-
-			input_event(input, EV_ABS, ABS_MT_POSITION_X, s->x);
-			input_event(input, EV_ABS, ABS_MT_POSITION_Y, s->y);
-			input_event(input, EV_ABS, ABS_MT_TOOL_X, s->cx);
-			input_event(input, EV_ABS, ABS_MT_TOOL_Y, s->cy);
-			input_event(input, EV_ABS, ABS_MT_DISTANCE,
-				!s->touch_state);
-			input_event(input, EV_ABS, ABS_MT_ORIENTATION, wide);
-			input_event(input, EV_ABS, ABS_MT_PRESSURE, s->p);
-			input_event(input, EV_ABS, ABS_MT_TOUCH_MAJOR, major);
-			input_event(input, EV_ABS, ABS_MT_TOUCH_MINOR, minor);
+		if (active)
+			mt_slot_values(s, axis);
+
+		/*
+		 * coalescing: a contact that stays down or up is held until
+		 * the frame is published, one that changes is sent right away
+		 */
+		if (td->frame_interval) {
+			e->seen = td->frame;
+			if (active == e->active &&
+			    (!active || axis[MT_AXIS_DISTANCE] ==
+					e->axis[MT_AXIS_DISTANCE])) {
+				if (active)
+					memcpy(e->held, axis, sizeof(axis));
+				e->dirty = true;
+				td->num_received++;
+				return;
+			}
+			td->transition = true;
+			e->dirty = false;
 		}
+
+		input_mt_slot(input, slotnum);
+		input_mt_report_slot_state(input, MT_TOOL_FINGER, active);
+		if (active)
+			mt_emit_slot(td, input, slotnum, axis);
+		else
+			e->active = false;
 	}
 
 	td->num_received++;
 }
 
+static void mt_complete_slot(struct mt_device *td, struct input_dev *input)
+{
+	__mt_complete_slot(td, input, td->mtclass.quirks);
+}
+
+#define MT_SLOT_HANDLER(_name, _quirks)					\
+static void mt_complete_slot_##_name(struct mt_device *td,		\
+		struct input_dev *input)				\
+{									\
+	__mt_complete_slot(td, input, _quirks);				\
+}
+
+MT_SLOT_HANDLER(default, MT_QUIRK_ALWAYS_VALID |
+		MT_QUIRK_CONTACT_CNT_ACCURATE)
+MT_SLOT_HANDLER(win_8, MT_QUIRK_ALWAYS_VALID |
+		MT_QUIRK_IGNORE_DUPLICATES |
+		MT_QUIRK_CONTACT_CNT_ACCURATE)
+MT_SLOT_HANDLER(contactid, MT_QUIRK_SLOT_IS_CONTACTID)
+
+/* slot quirks of the common classes and their handlers */
+static const struct mt_slot_handler {
+	__s32 quirks;
+	void (*complete_slot)(struct mt_device *td, struct input_dev *input);
+} mt_slot_handlers[] = {
+	/* MT_CLS_DEFAULT, MT_CLS_EXPORT_ALL_INPUTS, MT_CLS_VTL */
+	{ MT_QUIRK_ALWAYS_VALID | MT_QUIRK_CONTACT_CNT_ACCURATE,
+		mt_complete_slot_default },
+	/* MT_CLS_WIN_8 */
+	{ MT_QUIRK_ALWAYS_VALID | MT_QUIRK_IGNORE_DUPLICATES |
+		MT_QUIRK_CONTACT_CNT_ACCURATE, mt_complete_slot_win_8 },
+	/* MT_CLS_GENERALTOUCH_*, MT_CLS_3M, MT_CLS_EGALAX */
+	{ MT_QUIRK_SLOT_IS_CONTACTID, mt_complete_slot_contactid },
+};
+
+/*
+ * pick the slot handler for the quirks in use, any combination without a
+ * specialised one goes through mt_complete_slot()
+ */
+static void mt_select_handlers(struct mt_device *td)
+{
+	__s32 quirks = td->mtclass.quirks & MT_SLOT_QUIRKS;
+	int i;
+
+	td->complete_slot = mt_complete_slot;
+	for (i = 0; i < ARRAY_SIZE(mt_slot_handlers); i++) {
+		if (mt_slot_handlers[i].quirks == quirks) {
+			td->complete_slot = mt_slot_handlers[i].complete_slot;
+			break;
+		}
+	}
+}
+
+static bool mt_drops_unused(struct input_dev *input)
+{
+	return input->mt && (input->mt->flags & INPUT_MT_DROP_UNUSED);
+}
+
+/*
+ * send what frames up to @frame hold back and end the input frame there.
+ * Called with frame_lock held.
+ */
+static void mt_publish_frame(struct mt_device *td, struct input_dev *input,
+		unsigned frame)
+{
+	bool drop = mt_drops_unused(input);
+	struct mt_emitted *e;
+	int i;
+
+	for (i = 0; i < td->maxcontacts; i++) {
+		e = &td->emitted[i];
+		if (drop && e->seen != frame) {
+			/* input_mt_sync_frame() releases it */
+			e->active = false;
+			e->dirty = false;
+			continue;
+		}
+		if (!e->dirty)
+			continue;
+
+		input_mt_slot(input, i);
+		input_mt_report_slot_state(input, MT_TOOL_FINGER, e->active);
+		if (e->active)
+			mt_emit_slot(td, input, i, e->held);
+		e->dirty = false;
+	}
+
+	input_mt_sync_frame(input);
+	input_sync(input);
+	td->published = ktime_get_ns();
+	td->transition = false;
+	td->held = false;
+}
+
+/*
+ * Coalescing mode: a frame is published when a contact went down or up
+ * or a button changed in it, or when the last one is frame_interval old. The others only
+ * update the held values of their contacts; flush_timer publishes them
+ * if no frame comes when the interval is over.
+ */
+static void mt_coalesce_frame(struct mt_device *td, struct input_dev *input)
+{
+	u64 now = ktime_get_ns();
+	int i;
+
+	/* contacts missing from the frame are released by input-mt */
+	if (mt_drops_unused(input))
+		for (i = 0; i < td->maxcontacts; i++)
+			if (td->emitted[i].active &&
+			    td->emitted[i].seen != td->frame)
+				td->transition = true;
+
+	if (td->transition || now - td->published >= td->frame_interval)
+		mt_publish_frame(td, input, td->frame);
+	else if (!td->held) {
+		td->held = true;
+		hrtimer_start(&td->flush_timer,
+			      ns_to_ktime(td->published + td->frame_interval -
+					  now), HRTIMER_MODE_REL);
+	}
+	td->frame++;
+}
+
+static enum hrtimer_restart mt_flush_timer(struct hrtimer *timer)
+{
+	struct mt_device *td = container_of(timer, struct mt_device,
+					    flush_timer);
+	unsigned long flags;
+
+	/* a frame being read is published by mt_coalesce_frame() */
+	spin_lock_irqsave(&td->frame_lock, flags);
+	if (td->held && !td->num_received)
+		mt_publish_frame(td, td->input, td->frame - 1);
+	spin_unlock_irqrestore(&td->frame_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
 /*
  * this function is called when a whole packet has been received and processed,
  * so that it can decide what to send to the input layer.
  */
 static void mt_sync_frame(struct mt_device *td, struct input_dev *input)
 {
-	input_mt_sync_frame(input);
-	input_sync(input);
+	int i;
+
+	if (td->frame_interval)
+		mt_coalesce_frame(td, input);
+	else if (td->held)
+		/* coalescing was turned off while this frame was read */
+		mt_publish_frame(td, input, td->frame);
+	else {
+		if (mt_drops_unused(input))
+			for (i = 0; i < td->maxcontacts; i++)
+				/* input_mt_sync_frame() releases it */
+				if (!input_mt_is_used(input->mt,
+						      &input->mt->slots[i]))
+					td->emitted[i].active = false;
+		input_mt_sync_frame(input);
+		input_sync(input);
+	}
 	td->num_received = 0;
 }
 
@@ -659,82 +1013,145 @@ static int mt_touch_event(struct hid_device *hid, struct hid_field *field,
 	return 1;
 }
 
-static void mt_process_mt_event(struct hid_device *hid, struct hid_field *field,
-				struct hid_usage *usage, __s32 value)
+static void mt_plan_add(struct mt_device *td, const __s32 *value,
+		__s32 *dest, __u8 type, __u16 code)
 {
-	struct mt_device *td = hid_get_drvdata(hid);
+	struct mt_plan_entry *e = &td->plan[td->plan_length++];
+
+	e->value = value;
+	e->dest = dest;
+	e->type = type;
+	e->code = code;
+	e->last = false;
+}
+
+/*
+ * compile what mt_touch_report() does with each value of the multitouch
+ * report, for the current quirks
+ */
+static void mt_build_plan(struct mt_device *td)
+{
+	struct hid_report *report = td->mt_report;
+	struct mt_slot *s = &td->curdata;
 	__s32 quirks = td->mtclass.quirks;
-	struct input_dev *input = field->hidinput->input;
+	struct hid_field *field;
+	struct hid_usage *usage;
+	const __s32 *value;
+	unsigned count, first;
+	int r, n;
 
-	if (hid->claimed & HID_CLAIMED_INPUT) {
-		switch (usage->hid) {
-		case HID_DG_INRANGE:
-			if (quirks & MT_QUIRK_VALID_IS_INRANGE)
-				td->curvalid = value;
-			if (quirks & MT_QUIRK_HOVERING)
-				td->curdata.inrange_state = value;
-			break;
-		case HID_DG_TIPSWITCH:
-			if (quirks & MT_QUIRK_NOT_SEEN_MEANS_UP)
-				td->curvalid = value;
-			td->curdata.touch_state = value;
-			break;
-		case HID_DG_CONFIDENCE:
-			if (quirks & MT_QUIRK_VALID_IS_CONFIDENCE)
-				td->curvalid = value;
-			break;
-		case HID_DG_CONTACTID:
-			td->curdata.contactid = value;
-			break;
-		case HID_DG_TIPPRESSURE:
-			td->curdata.p = value;
-			break;
-		case HID_GD_X:
-			if (usage->code == ABS_MT_TOOL_X)
-				td->curdata.cx = value;
-			else
-				td->curdata.x = value;
-			break;
-		case HID_GD_Y:
-			if (usage->code == ABS_MT_TOOL_Y)
-				td->curdata.cy = value;
-			else
-				td->curdata.y = value;
-			break;
-		case HID_DG_WIDTH:
-			td->curdata.w = value;
-			break;
-		case HID_DG_HEIGHT:
-			td->curdata.h = value;
-			break;
-		case HID_DG_CONTACTCOUNT:
-			break;
-		case HID_DG_TOUCH:
-			/* do nothing */
-			break;
+	if (!report || !td->plan)
+		return;
 
-		default:
-			if (usage->type)
-				input_event(input, usage->type, usage->code,
-						value);
-			return;
-		}
+	td->plan_length = 0;
+
+	for (r = 0; r < report->maxfield; r++) {
+		field = report->field[r];
+		count = field->report_count;
+
+		if (!(HID_MAIN_ITEM_VARIABLE & field->flags))
+			continue;
+
+		for (n = 0; n < count; n++) {
+			usage = &field->usage[n];
+			value = &field->value[n];
+			first = td->plan_length;
+
+			switch (usage->hid) {
+			case HID_DG_INRANGE:
+				if (quirks & MT_QUIRK_VALID_IS_INRANGE)
+					mt_plan_add(td, value, &td->curvalid,
+						    0, 0);
+				if (quirks & MT_QUIRK_HOVERING)
+					mt_plan_add(td, value,
+						    &s->inrange_state, 0, 0);
+				break;
+			case HID_DG_TIPSWITCH:
+				if (quirks & MT_QUIRK_NOT_SEEN_MEANS_UP)
+					mt_plan_add(td, value, &td->curvalid,
+						    0, 0);
+				mt_plan_add(td, value, &s->touch_state, 0, 0);
+				break;
+			case HID_DG_CONFIDENCE:
+				if (quirks & MT_QUIRK_VALID_IS_CONFIDENCE)
+					mt_plan_add(td, value, &td->curvalid,
+						    0, 0);
+				break;
+			case HID_DG_CONTACTID:
+				mt_plan_add(td, value, &s->contactid, 0, 0);
+				break;
+			case HID_DG_TIPPRESSURE:
+				mt_plan_add(td, value, &s->p, 0, 0);
+				break;
+			case HID_GD_X:
+				mt_plan_add(td, value,
+					    usage->code == ABS_MT_TOOL_X ?
+					    &s->cx : &s->x, 0, 0);
+				break;
+			case HID_GD_Y:
+				mt_plan_add(td, value,
+					    usage->code == ABS_MT_TOOL_Y ?
+					    &s->cy : &s->y, 0, 0);
+				break;
+			case HID_DG_WIDTH:
+				mt_plan_add(td, value, &s->w, 0, 0);
+				break;
+			case HID_DG_HEIGHT:
+				mt_plan_add(td, value, &s->h, 0, 0);
+				break;
+			case HID_DG_CONTACTCOUNT:
+				break;
+			case HID_DG_TOUCH:
+				/* do nothing */
+				break;
+
+			default:
+				if (usage->type)
+					mt_plan_add(td, value, NULL,
+						    usage->type, usage->code);
+				continue;
+			}
 
-		if (usage->usage_index + 1 == field->report_count) {
 			/* we only take into account the last report. */
-			if (usage->hid == td->last_slot_field)
-				mt_complete_slot(td, field->hidinput->input);
+			if (n + 1 == count && usage->hid == td->last_slot_field) {
+				if (td->plan_length == first)
+					mt_plan_add(td, value, NULL, 0, 0);
+				td->plan[td->plan_length - 1].last = true;
+			}
 		}
-
 	}
 }
 
+/*
+ * room for the plan of @report: a value is at most stored in two places,
+ * see mt_build_plan()
+ */
+static int mt_alloc_plan(struct hid_device *hdev, struct hid_report *report)
+{
+	struct mt_device *td = hid_get_drvdata(hdev);
+	unsigned size = 0;
+	int r;
+
+	for (r = 0; r < report->maxfield; r++)
+		size += report->field[r]->report_count;
+
+	td->plan = devm_kcalloc(&hdev->dev, max(2 * size, 1U),
+				sizeof(*td->plan), GFP_KERNEL);
+	if (!td->plan)
+		return -ENOMEM;
+
+	td->mt_report = report;
+	return 0;
+}
+
 static void mt_touch_report(struct hid_device *hid, struct hid_report *report)
 {
 	struct mt_device *td = hid_get_drvdata(hid);
-	struct hid_field *field;
-	unsigned count;
-	int r, n;
+	struct input_dev *input = report->field[0]->hidinput->input;
+	const struct mt_plan_entry *e, *end = td->plan + td->plan_length;
+	unsigned long flags;
+
+	spin_lock_irqsave(&td->frame_lock, flags);
 
 	/*
 	 * Includes multi-packet support where subsequent
@@ -747,20 +1164,24 @@ static void mt_touch_report(struct hid_device *hid, struct hid_report *report)
 			td->num_expected = value;
 	}
 
-	for (r = 0; r < report->maxfield; r++) {
-		field = report->field[r];
-		count = field->report_count;
-
-		if (!(HID_MAIN_ITEM_VARIABLE & field->flags))
-			continue;
-
-		for (n = 0; n < count; n++)
-			mt_process_mt_event(hid, field, &field->usage[n],
-					field->value[n]);
+	for (e = td->plan; e < end; e++) {
+		if (e->dest)
+			*e->dest = *e->value;
+		else if (e->type) {
+			/* a button change is not held by coalescing */
+			if (e->type == EV_KEY &&
+			    !*e->value != !test_bit(e->code, input->key))
+				td->transition = true;
+			input_event(input, e->type, e->code, *e->value);
+		}
+		if (e->last)
+			td->complete_slot(td, input);
 	}
 
 	if (td->num_received >= td->num_expected)
-		mt_sync_frame(td, report->field[0]->hidinput->input);
+		mt_sync_frame(td, input);
+
+	spin_unlock_irqrestore(&td->frame_lock, flags);
 }
 
 static int mt_touch_input_configured(struct hid_device *hdev,
@@ -774,10 +1195,22 @@ static int mt_touch_input_configured(struct hid_device *hdev,
 	if (!td->maxcontacts)
 		td->maxcontacts = MT_DEFAULT_MAXCONTACT;
 
+	td->emitted = devm_kcalloc(&hdev->dev, td->maxcontacts,
+				   sizeof(*td->emitted), GFP_KERNEL);
+	if (!td->emitted)
+		return -ENOMEM;
+	td->input = input;
+
 	mt_post_parse(td);
 	if (td->serial_maybe)
 		mt_post_parse_default_settings(td);
 
+	ret = mt_alloc_plan(hdev, hi->report);
+	if (ret)
+		return ret;
+	mt_select_handlers(td);
+	mt_build_plan(td);
+
 	if (cls->is_indirect)
 		td->mt_flags |= INPUT_MT_POINTER;
 
@@ -884,14 +1317,18 @@ static void mt_report(struct hid_device *hid, struct hid_report *report)
 		input_sync(field->hidinput->input);
 }
 
-static void mt_set_input_mode(struct hid_device *hdev)
+/*
+ * The InputMode and Contact Count Maximum fields hold what the device was
+ * last told, or what it reported. Unless it was reset, a SET_REPORT
+ * asking for the same value again is skipped.
+ */
+static void mt_set_input_mode(struct hid_device *hdev, bool reprogram)
 {
 	struct mt_device *td = hid_get_drvdata(hdev);
 	struct hid_report *r;
 	struct hid_report_enum *re;
 	struct mt_class *cls = &td->mtclass;
-	char *buf;
-	int report_len;
+	__s32 *value;
 
 	if (td->inputmode < 0)
 		return;
@@ -899,24 +1336,22 @@ static void mt_set_input_mode(struct hid_device *hdev)
 	re = &(hdev->report_enum[HID_FEATURE_REPORT]);
 	r = re->report_id_hash[td->inputmode];
 	if (r) {
-		if (cls->quirks & MT_QUIRK_FORCE_GET_FEATURE) {
-			report_len = hid_report_len(r);
-			buf = hid_alloc_report_buf(r, GFP_KERNEL);
-			if (!buf) {
-				hid_err(hdev, "failed to allocate buffer for report\n");
-				return;
-			}
-			hid_hw_raw_request(hdev, r->id, buf, report_len,
+		value = &r->field[0]->value[td->inputmode_index];
+		if (*value == td->inputmode_value && !reprogram)
+			return;
+
+		if ((cls->quirks & MT_QUIRK_FORCE_GET_FEATURE) &&
+		    td->inputmode_buf)
+			hid_hw_raw_request(hdev, r->id, td->inputmode_buf,
+					   hid_report_len(r),
 					   HID_FEATURE_REPORT,
 					   HID_REQ_GET_REPORT);
-			kfree(buf);
-		}
-		r->field[0]->value[td->inputmode_index] = td->inputmode_value;
+		*value = td->inputmode_value;
 		hid_hw_request(hdev, r, HID_REQ_SET_REPORT);
 	}
 }
 
-static void mt_set_maxcontacts(struct hid_device *hdev)
+static void mt_set_maxcontacts(struct hid_device *hdev, bool reprogram)
 {
 	struct mt_device *td = hid_get_drvdata(hdev);
 	struct hid_report *r;
@@ -935,13 +1370,61 @@ static void mt_set_maxcontacts(struct hid_device *hdev)
 		max = td->mtclass.maxcontacts;
 		fieldmax = r->field[0]->logical_maximum;
 		max = min(fieldmax, max);
-		if (r->field[0]->value[0] != max) {
+		if (r->field[0]->value[0] != max || reprogram) {
 			r->field[0]->value[0] = max;
 			hid_hw_request(hdev, r, HID_REQ_SET_REPORT);
 		}
 	}
 }
 
+/*
+ * feature transfers are slow, they are done here rather than in the
+ * probe and PM callbacks that ask for them
+ */
+static void mt_config_work(struct work_struct *work)
+{
+	struct mt_device *td = container_of(work, struct mt_device,
+					    config_work);
+	struct hid_device *hdev = td->hdev;
+	bool reprogram;
+
+	if (test_and_clear_bit(MT_CONFIG_IDLE, &td->config))
+		hid_hw_idle(hdev, 0, 0, HID_REQ_SET_IDLE);
+
+	reprogram = test_and_clear_bit(MT_CONFIG_REPROGRAM, &td->config);
+	if (test_and_clear_bit(MT_CONFIG_FEATURES, &td->config)) {
+		mt_set_maxcontacts(hdev, reprogram);
+		mt_set_input_mode(hdev, reprogram);
+	}
+}
+
+static void mt_schedule_config(struct mt_device *td, unsigned long config)
+{
+	int bit;
+
+	for_each_set_bit(bit, &config, BITS_PER_LONG)
+		set_bit(bit, &td->config);
+	schedule_work(&td->config_work);
+}
+
+/* the buffer mt_set_input_mode() reads the InputMode feature into */
+static void mt_alloc_inputmode_buf(struct hid_device *hdev)
+{
+	struct mt_device *td = hid_get_drvdata(hdev);
+	struct hid_report *r;
+
+	if (td->inputmode < 0)
+		return;
+
+	r = hdev->report_enum[HID_FEATURE_REPORT].report_id_hash[td->inputmode];
+	if (!r)
+		return;
+
+	td->inputmode_buf = hid_alloc_report_buf(r, GFP_KERNEL);
+	if (!td->inputmode_buf)
+		hid_err(hdev, "failed to allocate buffer for report\n");
+}
+
 static void mt_post_parse_default_settings(struct mt_device *td)
 {
 	__s32 quirks = td->mtclass.quirks;
@@ -1092,7 +1575,13 @@ static int mt_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		dev_err(&hdev->dev, "cannot allocate multitouch data\n");
 		return -ENOMEM;
 	}
+	td->hdev = hdev;
 	td->mtclass = *mtclass;
+	mt_select_handlers(td);
+	INIT_WORK(&td->config_work, mt_config_work);
+	spin_lock_init(&td->frame_lock);
+	hrtimer_init(&td->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	td->flush_timer.function = mt_flush_timer;
 	td->inputmode = -1;
 	td->maxcontact_report_id = -1;
 	td->inputmode_value = MT_INPUTMODE_TOUCHSCREEN;
@@ -1120,8 +1609,8 @@ static int mt_probe(struct hid_device *hdev, const struct hid_device_id *id)
 
 	ret = sysfs_create_group(&hdev->dev.kobj, &mt_attribute_group);
 
-	mt_set_maxcontacts(hdev);
-	mt_set_input_mode(hdev);
+	mt_alloc_inputmode_buf(hdev);
+	mt_schedule_config(td, BIT(MT_CONFIG_FEATURES));
 
 	/* release .fields memory as it is not used anymore */
 	devm_kfree(&hdev->dev, td->fields);
@@ -1133,8 +1622,10 @@ static int mt_probe(struct hid_device *hdev, const struct hid_device_id *id)
 #ifdef CONFIG_PM
 static int mt_reset_resume(struct hid_device *hdev)
 {
-	mt_set_maxcontacts(hdev);
-	mt_set_input_mode(hdev);
+	struct mt_device *td = hid_get_drvdata(hdev);
+
+	mt_schedule_config(td, BIT(MT_CONFIG_FEATURES) |
+			   BIT(MT_CONFIG_REPROGRAM));
 	return 0;
 }
 
@@ -1144,7 +1635,7 @@ static int mt_resume(struct hid_device *hdev)
 	 * It should be safe to send it to other devices too.
 	 * Tested on 3M, Stantum, Cypress, Zytronic, eGalax, and Elan panels. */
 
-	hid_hw_idle(hdev, 0, 0, HID_REQ_SET_IDLE);
+	mt_schedule_config(hid_get_drvdata(hdev), BIT(MT_CONFIG_IDLE));
 
 	return 0;
 }
@@ -1152,8 +1643,20 @@ static int mt_resume(struct hid_device *hdev)
 
 static void mt_remove(struct hid_device *hdev)
 {
+	struct mt_device *td = hid_get_drvdata(hdev);
+
 	sysfs_remove_group(&hdev->dev.kobj, &mt_attribute_group);
+	cancel_work_sync(&td->config_work);
+
+	/* no frame is held back, nor the timer armed again, from now on */
+	spin_lock_irq(&td->frame_lock);
+	td->frame_interval = 0;
+	td->held = false;
+	spin_unlock_irq(&td->frame_lock);
+	hrtimer_cancel(&td->flush_timer);
+
 	hid_hw_stop(hdev);
+	kfree(td->inputmode_buf);
 }
 
 /*
@@ -0,0 +1,489 @@
+/*
+ * Synthetic load for greentouch.c through uhid
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Creates -P virtual panels with the GreenTouch USB ids and a ten finger
+ * touch screen report descriptor, and has each of them send reports of
+ * -c contacts circling the screen at -s Hz for -d seconds, one thread per
+ * panel. uhid hands a report to the HID core from write(), so the time a
+ * write takes is the time mt_touch_report() and the input core spend on
+ * it. The events are read back from the event device of every panel to
+ * count the frames reaching userspace, fewer than the reports once
+ * max_frame_rate coalesces them.
+ *
+ * Needs write access to /dev/uhid and greentouch bound to 0547:2001 rather
+ * than hid-multitouch. Build with "make uhid" in hid_multitouch/.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#define GREENTOUCH_VENDOR	0x0547
+#define GREENTOUCH_PRODUCT	0x2001
+
+/* the descriptor has this many contacts per report, -c uses the first ones */
+#define UHID_CONTACTS		10
+#define UHID_LOGICAL_MAX	4095
+#define UHID_REPORT_ID		1
+#define UHID_FEATURE_ID		2
+/* report id, then tip switch, contact id, x and y per contact, then the count */
+#define UHID_CONTACT_SIZE	6
+#define UHID_REPORT_SIZE	(1 + UHID_CONTACTS * UHID_CONTACT_SIZE + 1)
+
+/* one virtual panel */
+struct uhid_panel {
+	int			index;
+	int			uhid;		/* /dev/uhid, one device per open */
+	int			event;		/* its event device */
+	char			uniq[64];
+	pthread_t		writer, reader, service;
+	unsigned int		contacts;
+	uint64_t		period_ns;
+	uint64_t		duration_ns;
+	uint64_t		*latency;	/* ns per write */
+	unsigned long		reports;
+	unsigned long		frames;		/* SYN_REPORTs read back */
+	uint64_t		wall_ns;
+	uint64_t		cpu_ns;		/* of the writer thread */
+	uint64_t		reader_cpu_ns;
+	volatile bool		stop;
+	int			error;
+};
+
+static uint64_t uhid_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *uhid_alloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Touch screen application collection: UHID_CONTACTS finger collections
+ * of tip switch, contact id, x and y, the contact count, and a feature
+ * report with the contact count maximum.
+ */
+static size_t uhid_descriptor(unsigned char *d)
+{
+	static const unsigned char head[] = {
+		0x05, 0x0d,		/* Usage Page (Digitizer) */
+		0x09, 0x04,		/* Usage (Touch Screen) */
+		0xa1, 0x01,		/* Collection (Application) */
+		0x85, UHID_REPORT_ID,	/*  Report ID */
+	};
+	static const unsigned char finger[] = {
+		0x05, 0x0d,		/*  Usage Page (Digitizer) */
+		0x09, 0x22,		/*  Usage (Finger) */
+		0xa1, 0x02,		/*  Collection (Logical) */
+		0x09, 0x42,		/*   Usage (Tip Switch) */
+		0x15, 0x00,		/*   Logical Minimum (0) */
+		0x25, 0x01,		/*   Logical Maximum (1) */
+		0x75, 0x01,		/*   Report Size (1) */
+		0x95, 0x01,		/*   Report Count (1) */
+		0x81, 0x02,		/*   Input (Data,Var,Abs) */
+		0x95, 0x07,		/*   Report Count (7) */
+		0x81, 0x03,		/*   Input (Cnst,Var,Abs) */
+		0x09, 0x51,		/*   Usage (Contact Identifier) */
+		0x25, 0x7f,		/*   Logical Maximum (127) */
+		0x75, 0x08,		/*   Report Size (8) */
+		0x95, 0x01,		/*   Report Count (1) */
+		0x81, 0x02,		/*   Input (Data,Var,Abs) */
+		0x05, 0x01,		/*   Usage Page (Generic Desktop) */
+		0x26, UHID_LOGICAL_MAX & 0xff, UHID_LOGICAL_MAX >> 8,
+					/*   Logical Maximum */
+		0x75, 0x10,		/*   Report Size (16) */
+		0x95, 0x01,		/*   Report Count (1) */
+		0x09, 0x30,		/*   Usage (X) */
+		0x81, 0x02,		/*   Input (Data,Var,Abs) */
+		0x09, 0x31,		/*   Usage (Y) */
+		0x81, 0x02,		/*   Input (Data,Var,Abs) */
+		0xc0,			/*  End Collection */
+	};
+	static const unsigned char tail[] = {
+		0x05, 0x0d,		/*  Usage Page (Digitizer) */
+		0x09, 0x54,		/*  Usage (Contact Count) */
+		0x25, 0x7f,		/*  Logical Maximum (127) */
+		0x75, 0x08,		/*  Report Size (8) */
+		0x95, 0x01,		/*  Report Count (1) */
+		0x81, 0x02,		/*  Input (Data,Var,Abs) */
+		0x85, UHID_FEATURE_ID,	/*  Report ID */
+		0x09, 0x55,		/*  Usage (Contact Count Maximum) */
+		0x25, UHID_CONTACTS,	/*  Logical Maximum */
+		0xb1, 0x02,		/*  Feature (Data,Var,Abs) */
+		0xc0,			/* End Collection */
+	};
+	size_t size = 0;
+	int i;
+
+	memcpy(d, head, sizeof(head));
+	size += sizeof(head);
+	for (i = 0; i < UHID_CONTACTS; i++) {
+		memcpy(d + size, finger, sizeof(finger));
+		size += sizeof(finger);
+	}
+	memcpy(d + size, tail, sizeof(tail));
+	return size + sizeof(tail);
+}
+
+static int uhid_send(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	if (ret < 0)
+		return -errno;
+	return ret == sizeof(*ev) ? 0 : -EFAULT;
+}
+
+/* answer the feature requests of the driver for the whole run */
+static void *uhid_service(void *arg)
+{
+	struct uhid_panel *p = arg;
+	struct uhid_event ev, reply;
+	struct pollfd pfd = { .fd = p->uhid, .events = POLLIN };
+
+	while (!p->stop) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(p->uhid, &ev, sizeof(ev)) <= 0)
+			break;
+
+		memset(&reply, 0, sizeof(reply));
+		switch (ev.type) {
+		case UHID_GET_REPORT:
+			reply.type = UHID_GET_REPORT_REPLY;
+			reply.u.get_report_reply.id = ev.u.get_report.id;
+			if (ev.u.get_report.rnum == UHID_FEATURE_ID) {
+				reply.u.get_report_reply.data[0] = UHID_FEATURE_ID;
+				reply.u.get_report_reply.data[1] = UHID_CONTACTS;
+				reply.u.get_report_reply.size = 2;
+			} else {
+				reply.u.get_report_reply.err = EIO;
+			}
+			uhid_send(p->uhid, &reply);
+			break;
+		case UHID_SET_REPORT:
+			reply.type = UHID_SET_REPORT_REPLY;
+			reply.u.set_report_reply.id = ev.u.set_report.id;
+			uhid_send(p->uhid, &reply);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int uhid_create(struct uhid_panel *p)
+{
+	struct uhid_event ev;
+
+	p->uhid = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (p->uhid < 0) {
+		fprintf(stderr, "/dev/uhid: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "GreenTouch uhid panel %d", p->index);
+	snprintf(p->uniq, sizeof(p->uniq), "greentouch-uhid-%d-%d",
+		 getpid(), p->index);
+	strcpy((char *)ev.u.create2.uniq, p->uniq);
+	ev.u.create2.rd_size = uhid_descriptor(ev.u.create2.rd_data);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = GREENTOUCH_VENDOR;
+	ev.u.create2.product = GREENTOUCH_PRODUCT;
+	if (uhid_send(p->uhid, &ev)) {
+		fprintf(stderr, "UHID_CREATE2: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return pthread_create(&p->service, NULL, uhid_service, p) ? -1 : 0;
+}
+
+/* the event device with our uniq, once the driver has bound */
+static int uhid_find_event(struct uhid_panel *p)
+{
+	char path[300], uniq[64];
+	struct dirent *entry;
+	int tries, fd, clock = CLOCK_MONOTONIC;
+	DIR *dir;
+
+	for (tries = 0; tries < 50; tries++) {
+		dir = opendir("/dev/input");
+		while (dir && (entry = readdir(dir))) {
+			if (strncmp(entry->d_name, "event", 5))
+				continue;
+			snprintf(path, sizeof(path), "/dev/input/%s",
+				 entry->d_name);
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (fd < 0)
+				continue;
+			memset(uniq, 0, sizeof(uniq));
+			if (ioctl(fd, EVIOCGUNIQ(sizeof(uniq) - 1), uniq) >= 0 &&
+			    !strcmp(uniq, p->uniq)) {
+				closedir(dir);
+				ioctl(fd, EVIOCSCLOCKID, &clock);
+				p->event = fd;
+				return 0;
+			}
+			close(fd);
+		}
+		if (dir)
+			closedir(dir);
+		usleep(100000);
+	}
+
+	fprintf(stderr, "%s: no event device, is greentouch bound?\n",
+		p->uniq);
+	return -1;
+}
+
+/* drain the event device, counting frames */
+static void *uhid_reader(void *arg)
+{
+	struct uhid_panel *p = arg;
+	struct pollfd pfd = { .fd = p->event, .events = POLLIN };
+	struct input_event events[64];
+	ssize_t got;
+	int i;
+
+	while (!p->stop) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		got = read(p->event, events, sizeof(events));
+		for (i = 0; i < got / (ssize_t)sizeof(*events); i++)
+			if (events[i].type == EV_SYN &&
+			    events[i].code == SYN_REPORT)
+				p->frames++;
+	}
+	p->reader_cpu_ns = uhid_clock(CLOCK_THREAD_CPUTIME_ID);
+
+	return NULL;
+}
+
+/* report @k: the contacts circle the screen, one turn every 250 reports */
+static void uhid_fill(const struct uhid_panel *p, unsigned long k,
+		      unsigned char *report)
+{
+	unsigned char *c;
+	double angle;
+	unsigned int i;
+	int x, y;
+
+	memset(report, 0, UHID_REPORT_SIZE);
+	report[0] = UHID_REPORT_ID;
+	for (i = 0; i < p->contacts; i++) {
+		c = report + 1 + i * UHID_CONTACT_SIZE;
+		angle = 2 * M_PI * ((double)(k % 250) / 250 +
+				    (double)i / p->contacts);
+		x = UHID_LOGICAL_MAX / 2 + (int)(1500 * cos(angle));
+		y = UHID_LOGICAL_MAX / 2 + (int)(1500 * sin(angle));
+		c[0] = 1;
+		c[1] = i;
+		c[2] = x & 0xff;
+		c[3] = x >> 8;
+		c[4] = y & 0xff;
+		c[5] = y >> 8;
+	}
+	report[UHID_REPORT_SIZE - 1] = p->contacts;
+}
+
+static void *uhid_writer(void *arg)
+{
+	struct uhid_panel *p = arg;
+	struct uhid_event ev;
+	struct timespec ts;
+	uint64_t start, due, t, cpu;
+	unsigned long k;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = UHID_REPORT_SIZE;
+
+	cpu = uhid_clock(CLOCK_THREAD_CPUTIME_ID);
+	start = uhid_clock(CLOCK_MONOTONIC);
+	for (k = 0; (due = start + k * p->period_ns) < start + p->duration_ns; k++) {
+		if (uhid_clock(CLOCK_MONOTONIC) < due) {
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+		uhid_fill(p, k, ev.u.input2.data);
+		t = uhid_clock(CLOCK_MONOTONIC);
+		p->error = -uhid_send(p->uhid, &ev);
+		if (p->error)
+			break;
+		p->latency[k] = uhid_clock(CLOCK_MONOTONIC) - t;
+	}
+	p->reports = k;
+	t = uhid_clock(CLOCK_MONOTONIC) - start;
+	/* a panel keeping up is done when the duration is over */
+	p->wall_ns = t > p->duration_ns ? t : p->duration_ns;
+	p->cpu_ns = uhid_clock(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+	return NULL;
+}
+
+static int uhid_compare(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static unsigned int uhid_option(const char *arg, unsigned int lo,
+				unsigned int hi)
+{
+	char *end;
+	unsigned long val = strtoul(arg, &end, 0);
+
+	if (*end || val < lo || val > hi) {
+		fprintf(stderr, "%s is not within %u..%u\n", arg, lo, hi);
+		exit(2);
+	}
+	return val;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -s RATE   reports a second per panel (default 1000)\n"
+		"  -P N      panels (default 1)\n"
+		"  -c N      contacts per report, at most %d (default %d)\n"
+		"  -d N      seconds to run for (default 5)\n",
+		name, UHID_CONTACTS, UHID_CONTACTS);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rate = 1000, panels = 1, contacts = UHID_CONTACTS;
+	unsigned int seconds = 5, i;
+	unsigned long per_panel, done = 0, frames = 0;
+	double rps = 0, cpu = 0;
+	struct uhid_panel *panel;
+	struct uhid_event ev;
+	uint64_t *latency;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:P:c:d:h")) != -1) {
+		switch (opt) {
+		case 's':
+			rate = uhid_option(optarg, 1, 100000);
+			break;
+		case 'P':
+			panels = uhid_option(optarg, 1, 256);
+			break;
+		case 'c':
+			contacts = uhid_option(optarg, 1, UHID_CONTACTS);
+			break;
+		case 'd':
+			seconds = uhid_option(optarg, 1, 3600);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	panel = uhid_alloc(panels, sizeof(*panel));
+	per_panel = ((uint64_t)seconds * 1000000000 + 1000000000 / rate - 1) /
+		(1000000000 / rate);
+	latency = uhid_alloc(per_panel * panels, sizeof(*latency));
+	for (i = 0; i < panels; i++) {
+		struct uhid_panel *p = &panel[i];
+
+		p->index = i;
+		p->contacts = contacts;
+		p->period_ns = 1000000000 / rate;
+		p->duration_ns = (uint64_t)seconds * 1000000000;
+		p->latency = latency + per_panel * i;
+		if (uhid_create(p) || uhid_find_event(p))
+			return 1;
+	}
+
+	for (i = 0; i < panels; i++)
+		if (pthread_create(&panel[i].reader, NULL, uhid_reader, &panel[i]) ||
+		    pthread_create(&panel[i].writer, NULL, uhid_writer, &panel[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	for (i = 0; i < panels; i++)
+		pthread_join(panel[i].writer, NULL);
+	/* let the last frames reach the readers */
+	usleep(100000);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	for (i = 0; i < panels; i++) {
+		struct uhid_panel *p = &panel[i];
+
+		p->stop = true;
+		pthread_join(p->reader, NULL);
+		pthread_join(p->service, NULL);
+		uhid_send(p->uhid, &ev);
+		close(p->event);
+		close(p->uhid);
+		if (p->error) {
+			fprintf(stderr, "%s: %s\n", p->uniq, strerror(p->error));
+			return 1;
+		}
+
+		/* the latencies of all panels, one after the other */
+		memmove(latency + done, p->latency,
+			p->reports * sizeof(*latency));
+		done += p->reports;
+		frames += p->frames;
+		rps += 1e9 * p->reports / p->wall_ns;
+		cpu += 100.0 * (p->cpu_ns + p->reader_cpu_ns) / p->wall_ns;
+	}
+	if (!done) {
+		fprintf(stderr, "no reports\n");
+		return 1;
+	}
+	qsort(latency, done, sizeof(*latency), uhid_compare);
+
+	printf("%u panels at %u Hz, %u contacts: %.0f reports/s, %.1f per panel, %lu of %lu frames read back\n",
+	       panels, rate, contacts, rps, rps / panels, frames, done);
+	printf("latency p50 %.1f us, p99 %.1f us, max %.1f us, cpu %.1f%% per panel\n",
+	       latency[done / 2] / 1e3, latency[done * 99 / 100] / 1e3,
+	       latency[done - 1] / 1e3, cpu / panels);
+
+	return 0;
+}
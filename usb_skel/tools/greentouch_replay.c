@@ -0,0 +1,845 @@
+/*
+ * GreenTouch pipeline replay and benchmark
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Runs usbskeleton_pipeline.c in userspace over recorded frames: a file of
+ * back to back FRAME_SIZE octet transfers, as read from the bulk in
+ * endpoint. The first calibration_frames frames calibrate, the contacts
+ * of every other frame are printed one line per frame:
+ *
+ *	<frame index> <count> <x>,<y> ...
+ *
+ * With -b, the frames are instead run through each stage in turn and the
+ * time per frame and the heap allocations of every stage are reported.
+ * -g makes up frames with moving contacts when no recording is at hand.
+ *
+ * With -s, -P panels each score the frames at the given rate for -d
+ * seconds, one thread per panel, and the sustained frame rate, the
+ * latency from the time a frame is due to the end of its processing and
+ * the CPU time per panel are reported. With -i, the panels write to the
+ * debugfs inject files of real devices instead, the driver's latency
+ * file then has the processing side.
+ *
+ * Build with "make replay" in usb_skel/.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "usbskeleton_pipeline.h"
+
+/*
+ * Heap allocations are counted by wrapping the glibc allocator, the
+ * pipeline must not make any: it runs in the poll handler of the driver.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocations;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+#ifdef SKEL_HAVE_SIMD
+static const struct skel_kernels replay_sse2_kernels = {
+	.name = "sse2",
+	.accumulate = skel_accumulate_sse2,
+	.score = skel_score_sse2,
+};
+
+static const struct skel_kernels replay_avx2_kernels = {
+	.name = "avx2",
+	.accumulate = skel_accumulate_avx2,
+	.score = skel_score_avx2,
+};
+#endif
+
+/* what the driver keeps per device for the pipeline */
+struct replay {
+	struct skel_planes	*planes;	/* the planes below point into it */
+	unsigned short		*score_frame;
+	unsigned short		*score_frame_adjacent;
+	unsigned short		*score_last_frame_adjacent;
+	unsigned char		*average_frame;
+	unsigned short		*sigma_frame;
+	unsigned int		*recip_frame;
+	u32			*calib_sum;
+	u32			*calib_sumsq;
+	unsigned short		*box_scratch;
+	unsigned short		*average_q8;
+	unsigned short		*sigma_q8;
+	struct blob_label	*labels;
+	struct touch_contact	touch_contacts[MAX_CONTACTS];
+	struct skel_roi		roi;
+	struct skel_score_summary summary;
+
+	const struct skel_kernels *kernels;
+	struct skel_pipeline_options options;
+	int			frame_index;
+	bool			calibrated;
+};
+
+/* timing and allocations of one stage */
+struct replay_stage {
+	const char		*name;
+	u64			ns;
+	unsigned long		frames;
+	unsigned long		allocations;
+};
+
+enum replay_stage_id {
+	STAGE_ACCUMULATE,
+	STAGE_FINISH,
+	STAGE_SELECT,
+	STAGE_SCORE,
+	STAGE_FILTER,
+	STAGE_BASELINE,
+	STAGE_LABEL,
+	STAGE_POSITION,
+	STAGE_NORMALIZE,
+	REPLAY_STAGES
+};
+
+static struct replay_stage replay_stages[REPLAY_STAGES] = {
+	[STAGE_ACCUMULATE]	= { .name = "accumulate" },
+	[STAGE_FINISH]		= { .name = "finish" },
+	[STAGE_SELECT]		= { .name = "select" },
+	[STAGE_SCORE]		= { .name = "score" },
+	[STAGE_FILTER]		= { .name = "filter" },
+	[STAGE_BASELINE]	= { .name = "baseline" },
+	[STAGE_LABEL]		= { .name = "label" },
+	[STAGE_POSITION]	= { .name = "position" },
+	[STAGE_NORMALIZE]	= { .name = "normalize" },
+};
+
+static void *replay_plane(size_t n, size_t size)
+{
+	void *plane = calloc(n, size);
+
+	if (!plane) {
+		perror("calloc");
+		exit(1);
+	}
+	return plane;
+}
+
+static void replay_init(struct replay *r)
+{
+	struct skel_planes *planes;
+
+	memset(r, 0, sizeof(*r));
+	/* the same cache line aligned block as the driver's */
+	planes = aligned_alloc(64, sizeof(*planes));
+	if (!planes) {
+		perror("aligned_alloc");
+		exit(1);
+	}
+	memset(planes, 0, sizeof(*planes));
+	r->planes = planes;
+	r->score_frame = planes->score;
+	r->score_frame_adjacent = planes->adjacent[0];
+	r->score_last_frame_adjacent = planes->adjacent[1];
+	r->average_frame = planes->average;
+	r->sigma_frame = planes->sigma;
+	r->recip_frame = planes->recip;
+	r->calib_sum = planes->calib_sum;
+	r->calib_sumsq = planes->calib_sumsq;
+	r->box_scratch = planes->box_scratch;
+	r->average_q8 = planes->average_q8;
+	r->sigma_q8 = planes->sigma_q8;
+	r->labels = replay_plane(MAX_LABELS, sizeof(*r->labels));
+	r->kernels = &skel_scalar_kernels;
+	r->options.roi = true;
+	r->options.continuous = true;
+	r->options.window = ~0ULL;
+	r->options.threshold = SIGMA_THRESHOLD;
+	r->options.calibration_frames = CALIBRATION_FRAMES;
+	r->options.line_offset = BLOB_LINE_OFFSET;
+	r->options.max_contacts = MAX_CONTACTS;
+}
+
+/* the frame bookkeeping of skel_process_frame() */
+static int replay_frame(struct replay *r, unsigned char *frame)
+{
+	u64 scored_at;
+	int count;
+
+	count = normalize(frame, r->score_frame, r->score_frame_adjacent,
+			  r->score_last_frame_adjacent, r->average_frame,
+			  r->sigma_frame, r->recip_frame, r->calib_sum,
+			  r->calib_sumsq, r->box_scratch, r->kernels,
+			  r->frame_index, r->calibrated, &r->options,
+			  r->average_q8, r->sigma_q8, &r->roi, r->labels,
+			  r->touch_contacts, &r->summary, &scored_at);
+
+	if (r->calibrated) {
+		swap(r->score_frame_adjacent, r->score_last_frame_adjacent);
+		swap(r->roi.adjacent_tiles, r->roi.last_tiles);
+	}
+
+	if (!r->calibrated && r->frame_index == r->options.calibration_frames)
+		r->calibrated = true;
+
+	if (r->frame_index > CALIBRATE_EVERY && r->calibrated &&
+	    r->options.continuous) {
+		r->frame_index = r->options.calibration_frames;
+	} else if (r->frame_index > CALIBRATE_EVERY) {
+		r->frame_index = 0;
+		r->calibrated = false;
+	}
+	r->frame_index++;
+
+	return count;
+}
+
+/*
+ * Synthetic frames: a sloped baseline with up to @noise counts of noise,
+ * and after the calibration @fingers contacts circling the sensor, the
+ * ninth and later ones on an inner circle.
+ */
+static unsigned int replay_random(unsigned int *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return (*state >> 16) & 0x7fff;
+}
+
+static void replay_generate(unsigned char *frames, unsigned int n,
+			    unsigned int calibration, unsigned int fingers,
+			    unsigned int noise)
+{
+	static const int circle[16][2] = {
+		{ 16, 0 }, { 15, 6 }, { 11, 11 }, { 6, 15 },
+		{ 0, 16 }, { -6, 15 }, { -11, 11 }, { -15, 6 },
+		{ -16, 0 }, { -15, -6 }, { -11, -11 }, { -6, -15 },
+		{ 0, -16 }, { 6, -15 }, { 11, -11 }, { 15, -6 },
+	};
+	unsigned int state = 1, f, c, ring, phase;
+	unsigned char *frame;
+	int i, j, ci, cj, d, level;
+
+	for (f = 0; f < n; f++) {
+		frame = frames + (size_t)f * FRAME_SIZE;
+		memset(frame, 0, FRAME_SIZE);
+		for (i = 0; i < FRAME_ROWS; i++)
+			for (j = 0; j < FRAME_COLS; j++)
+				frame[FRAME_INDEX(i, j, BLOB_LINE_OFFSET)] = 90 + (i * 7 + j * 3) % 40 +
+					replay_random(&state) % (2 * noise + 1) - noise;
+
+		if (f < calibration + 8)
+			continue;
+
+		for (c = 0; c < fingers; c++) {
+			ring = c < 8 ? min(fingers, 8U) : fingers - 8;
+			phase = (f / 4 + c % 8 * 16 / ring) % 16;
+			ci = 32 + (circle[phase][0] >> (c / 8));
+			cj = 32 + (circle[phase][1] >> (c / 8));
+			for (i = max(ci - 3, 0); i <= min(ci + 3, FRAME_ROWS - 1); i++)
+				for (j = max(cj - 3, 0); j <= min(cj + 3, FRAME_COLS - 1); j++) {
+					d = abs(i - ci) + abs(j - cj);
+					if (d > 3)
+						continue;
+					level = frame[FRAME_INDEX(i, j, BLOB_LINE_OFFSET)] + 120 - 25 * d;
+					frame[FRAME_INDEX(i, j, BLOB_LINE_OFFSET)] = min(level, 255);
+				}
+		}
+	}
+}
+
+static unsigned char *replay_load(const char *path, unsigned int *n)
+{
+	unsigned char *frames = NULL, *grown;
+	size_t size = 0, used = 0, got;
+	FILE *file = stdin;
+
+	if (strcmp(path, "-")) {
+		file = fopen(path, "rb");
+		if (!file) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+
+	for (;;) {
+		if (used == size) {
+			size = size ? size * 2 : 256 * FRAME_SIZE;
+			grown = realloc(frames, size);
+			if (!grown) {
+				perror("realloc");
+				exit(1);
+			}
+			frames = grown;
+		}
+		got = fread(frames + used, 1, size - used, file);
+		if (!got)
+			break;
+		used += got;
+	}
+	if (ferror(file)) {
+		fprintf(stderr, "%s: read error\n", path);
+		exit(1);
+	}
+	if (file != stdin)
+		fclose(file);
+
+	if (used % FRAME_SIZE)
+		fprintf(stderr, "%s: ignoring %zu trailing octets\n",
+			path, used % FRAME_SIZE);
+	*n = used / FRAME_SIZE;
+	return frames;
+}
+
+static void replay_run(struct replay *r, unsigned char *frames, unsigned int n,
+		       bool quiet)
+{
+	unsigned long touched = 0, contacts = 0, scored = 0;
+	unsigned int f, peak = 0;
+	u64 score = 0;
+	int count, i, most = 0;
+
+	for (f = 0; f < n; f++) {
+		count = replay_frame(r, frames + (size_t)f * FRAME_SIZE);
+		if (!r->calibrated)
+			continue;
+
+		contacts += count;
+		touched += count > 0;
+		most = max(most, count);
+		scored++;
+		score += r->summary.sum;
+		peak = max_t(unsigned int, peak, r->summary.peak);
+		if (quiet)
+			continue;
+
+		printf("%u %d", f, count);
+		for (i = 0; i < count; i++)
+			printf(" %d,%d", r->touch_contacts[i].pos_x,
+			       r->touch_contacts[i].pos_y);
+		printf("\n");
+	}
+
+	fprintf(stderr, "%u frames, %lu with contacts, %lu contacts, at most %d in a frame\n",
+		n, touched, contacts, most);
+	if (scored)
+		fprintf(stderr, "score: peak %u, mean %.2f\n", peak,
+			(double)score / scored / FRAME_CELLS);
+	fprintf(stderr, "roi: %lu idle frames, %llu tiles active, %llu tiles processed\n",
+		(unsigned long)r->roi.idle_frames,
+		(unsigned long long)r->roi.tiles_active,
+		(unsigned long long)r->roi.tiles_processed);
+}
+
+/* account the time since *t to @stage and restart the clock */
+static inline void replay_lap(enum replay_stage_id stage, u64 *t,
+			      unsigned long *a)
+{
+	u64 now = ktime_get_ns();
+
+	replay_stages[stage].ns += now - *t;
+	replay_stages[stage].frames++;
+	replay_stages[stage].allocations += allocations - *a;
+	*a = allocations;
+	*t = now;
+}
+
+/*
+ * Same calls as normalize(), with the clock read between the stages.
+ * The clock costs a few tens of ns per lap, the normalize line has none
+ * of that overhead.
+ */
+static void replay_bench(struct replay *r, unsigned char *frames, unsigned int n,
+			 unsigned int iterations)
+{
+	const unsigned int frames_needed = r->options.calibration_frames;
+	const unsigned int calibration = min(n, frames_needed);
+	const unsigned char *frame;
+	struct replay_stage *stage;
+	unsigned int f, it, first;
+	unsigned long a;
+	u64 t, tiles, scored_at;
+	int count, ty;
+
+	/* calibration: every pass starts from zeroed sums */
+	for (it = 0; it < iterations; it++) {
+		memset(r->calib_sum, 0, FRAME_CELLS * sizeof(*r->calib_sum));
+		memset(r->calib_sumsq, 0, FRAME_CELLS * sizeof(*r->calib_sumsq));
+		a = allocations;
+		t = ktime_get_ns();
+		for (f = 0; f < frames_needed; f++) {
+			frame = frames + (size_t)(f % calibration) * FRAME_SIZE;
+			r->kernels->accumulate(frame, r->calib_sum, r->calib_sumsq,
+					       FRAME_CELLS);
+			replay_lap(STAGE_ACCUMULATE, &t, &a);
+		}
+		skel_calibrate_finish(r->calib_sum, r->calib_sumsq,
+				      r->average_frame, r->sigma_frame,
+				      r->average_q8, r->sigma_q8, frames_needed);
+		skel_update_recip(r->sigma_frame, r->recip_frame);
+		for (ty = 0; ty < ROI_TILES_Y; ty++)
+			skel_roi_update_gates(r->sigma_frame, &r->roi, ty,
+					      &r->options);
+		replay_lap(STAGE_FINISH, &t, &a);
+	}
+	r->calibrated = true;
+	r->frame_index = frames_needed;
+
+	/* a recording made of calibration frames only is scored as well */
+	first = n > frames_needed ? frames_needed : 0;
+
+	for (it = 0; it < iterations; it++)
+		for (f = first; f < n; f++) {
+			frame = frames + (size_t)f * FRAME_SIZE;
+			r->summary.sum = 0;
+			r->summary.peak = 0;
+			a = allocations;
+			t = ktime_get_ns();
+
+			tiles = skel_roi_select(frame, r->average_frame,
+						r->score_frame,
+						r->score_frame_adjacent, &r->roi,
+						&r->options);
+			replay_lap(STAGE_SELECT, &t, &a);
+			skel_score_tiles(r->kernels, frame, r->average_frame,
+					 r->recip_frame, r->score_frame, tiles,
+					 &r->options);
+			replay_lap(STAGE_SCORE, &t, &a);
+			r->roi.triggered = skel_filter_tiles(r->score_frame,
+							     r->score_frame_adjacent,
+							     r->score_last_frame_adjacent,
+							     r->box_scratch,
+							     r->options.threshold,
+							     tiles, &r->summary);
+			replay_lap(STAGE_FILTER, &t, &a);
+			if (r->options.continuous) {
+				ty = r->frame_index % ROI_TILES_Y;
+				skel_track_baseline(frame, r->average_frame,
+						    r->sigma_frame, r->recip_frame,
+						    r->average_q8, r->sigma_q8, ty,
+						    skel_roi_dilate(r->roi.triggered),
+						    &r->options);
+				skel_roi_update_gates(r->sigma_frame, &r->roi, ty,
+						      &r->options);
+				replay_lap(STAGE_BASELINE, &t, &a);
+			}
+			if (tiles) {
+				count = skel_label_contacts(r->score_frame_adjacent,
+							    r->options.threshold,
+							    r->labels,
+							    r->touch_contacts,
+							    r->options.max_contacts);
+				replay_lap(STAGE_LABEL, &t, &a);
+				skel_position_contacts(r->score_frame_adjacent,
+						       r->touch_contacts, count,
+						       r->options.peak_fit);
+				replay_lap(STAGE_POSITION, &t, &a);
+			}
+
+			swap(r->score_frame_adjacent, r->score_last_frame_adjacent);
+			swap(r->roi.adjacent_tiles, r->roi.last_tiles);
+			r->frame_index++;
+		}
+
+	stage = &replay_stages[STAGE_NORMALIZE];
+	for (it = 0; it < iterations; it++) {
+		a = allocations;
+		t = ktime_get_ns();
+		for (f = first; f < n; f++) {
+			normalize(frames + (size_t)f * FRAME_SIZE, r->score_frame,
+				  r->score_frame_adjacent,
+				  r->score_last_frame_adjacent, r->average_frame,
+				  r->sigma_frame, r->recip_frame, r->calib_sum,
+				  r->calib_sumsq, r->box_scratch, r->kernels,
+				  r->frame_index, true, &r->options,
+				  r->average_q8, r->sigma_q8, &r->roi, r->labels,
+				  r->touch_contacts, &r->summary, &scored_at);
+			swap(r->score_frame_adjacent, r->score_last_frame_adjacent);
+			swap(r->roi.adjacent_tiles, r->roi.last_tiles);
+			r->frame_index++;
+		}
+		stage->ns += ktime_get_ns() - t;
+		stage->frames += n - first;
+		stage->allocations += allocations - a;
+	}
+
+	printf("kernels %s, roi %s, peak fit %s, continuous %s, %u frames x %u\n",
+	       r->kernels->name, r->options.roi ? "on" : "off",
+	       r->options.peak_fit ? "on" : "off",
+	       r->options.continuous ? "on" : "off", n, iterations);
+	printf("%-12s %12s %12s %12s\n", "stage", "ns/frame", "frames/s",
+	       "alloc free");
+	for (stage = replay_stages; stage < replay_stages + REPLAY_STAGES; stage++) {
+		if (!stage->frames)
+			continue;
+		printf("%-12s %12.1f %12.0f %12s\n", stage->name,
+		       (double)stage->ns / stage->frames,
+		       stage->ns ? 1e9 * stage->frames / stage->ns : 0.0,
+		       stage->allocations ? "no" : "yes");
+	}
+}
+
+/* one panel of the stress mode */
+struct replay_panel {
+	struct replay		r;
+	pthread_t		thread;
+	const unsigned char	*frames;
+	unsigned int		n;
+	int			fd;		/* inject file, -1 to score here */
+	u64			period_ns;
+	u64			duration_ns;
+	u64			*latency;	/* ns from due to done, per frame */
+	unsigned long		frames_done;
+	u64			wall_ns;
+	u64			cpu_ns;
+	int			error;
+};
+
+static u64 replay_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *replay_panel_run(void *arg)
+{
+	struct replay_panel *p = arg;
+	const unsigned int calibration = p->r.options.calibration_frames;
+	const unsigned char *frame;
+	unsigned int first = 0;
+	struct timespec ts;
+	u64 start, due, cpu;
+	unsigned long k;
+
+	/* calibrate at full speed, a recorded calibration is not timed */
+	if (p->fd < 0) {
+		first = p->n > calibration ? calibration : 0;
+		for (k = 0; !p->r.calibrated; k++)
+			replay_frame(&p->r, (unsigned char *)p->frames +
+				     (size_t)(k % p->n) * FRAME_SIZE);
+	}
+
+	cpu = replay_cpu_ns();
+	start = ktime_get_ns();
+	for (k = 0; (due = start + k * p->period_ns) < start + p->duration_ns; k++) {
+		if (ktime_get_ns() < due) {
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+		frame = p->frames +
+			(size_t)(first + k % (p->n - first)) * FRAME_SIZE;
+		if (p->fd >= 0) {
+			if (write(p->fd, frame, FRAME_SIZE) != FRAME_SIZE) {
+				p->error = errno;
+				break;
+			}
+		} else {
+			replay_frame(&p->r, (unsigned char *)frame);
+		}
+		p->latency[k] = ktime_get_ns() - due;
+	}
+	p->frames_done = k;
+	/* a panel keeping up is done when the duration is over */
+	p->wall_ns = max(ktime_get_ns() - start, p->duration_ns);
+	p->cpu_ns = replay_cpu_ns() - cpu;
+
+	return NULL;
+}
+
+static int replay_compare(const void *a, const void *b)
+{
+	const u64 *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static void replay_stress(const struct replay *r, const unsigned char *frames,
+			  unsigned int n, unsigned int rate,
+			  unsigned int panels, unsigned int seconds,
+			  char **inject)
+{
+	struct replay_panel *panel = replay_plane(panels, sizeof(*panel));
+	const u64 period_ns = 1000000000 / rate;
+	const u64 duration_ns = (u64)seconds * 1000000000;
+	/* frames due within the duration, the first one at 0 */
+	const unsigned long per_panel = DIV_ROUND_UP(duration_ns, period_ns);
+	unsigned long done = 0;
+	double fps = 0, cpu = 0;
+	unsigned int i;
+	u64 *latency;
+
+	latency = replay_plane(per_panel * panels, sizeof(*latency));
+	for (i = 0; i < panels; i++) {
+		struct replay_panel *p = &panel[i];
+
+		replay_init(&p->r);
+		p->r.kernels = r->kernels;
+		p->r.options = r->options;
+		p->frames = frames;
+		p->n = n;
+		p->fd = -1;
+		if (inject) {
+			p->fd = open(inject[i], O_WRONLY);
+			if (p->fd < 0) {
+				fprintf(stderr, "%s: %s\n", inject[i],
+					strerror(errno));
+				exit(1);
+			}
+		}
+		p->period_ns = period_ns;
+		p->duration_ns = duration_ns;
+		p->latency = latency + per_panel * i;
+	}
+
+	for (i = 0; i < panels; i++)
+		if (pthread_create(&panel[i].thread, NULL, replay_panel_run,
+				   &panel[i])) {
+			perror("pthread_create");
+			exit(1);
+		}
+
+	/* the latencies of all panels, one after the other */
+	for (i = 0; i < panels; i++) {
+		struct replay_panel *p = &panel[i];
+
+		pthread_join(p->thread, NULL);
+		if (p->error) {
+			fprintf(stderr, "%s: %s\n", inject[i], strerror(p->error));
+			exit(1);
+		}
+		memmove(latency + done, p->latency,
+			p->frames_done * sizeof(*latency));
+		done += p->frames_done;
+		fps += 1e9 * p->frames_done / p->wall_ns;
+		cpu += 100.0 * p->cpu_ns / p->wall_ns;
+	}
+	if (!done) {
+		fprintf(stderr, "no frames\n");
+		exit(1);
+	}
+	qsort(latency, done, sizeof(*latency), replay_compare);
+
+	printf("%s, %u panels at %u Hz: %.0f frames/s, %.1f per panel\n",
+	       inject ? "inject" : r->kernels->name, panels, rate, fps,
+	       fps / panels);
+	printf("latency p50 %.1f us, p99 %.1f us, max %.1f us, cpu %.1f%% per panel\n",
+	       latency[done / 2] / 1e3, latency[done * 99 / 100] / 1e3,
+	       latency[done - 1] / 1e3, cpu / panels);
+}
+
+static const struct skel_kernels *replay_kernels(const char *name)
+{
+	if (!strcmp(name, "scalar"))
+		return &skel_scalar_kernels;
+#ifdef SKEL_HAVE_SIMD
+	if (!strcmp(name, "sse2"))
+		return &replay_sse2_kernels;
+	if (!strcmp(name, "avx2")) {
+		if (!__builtin_cpu_supports("avx2")) {
+			fprintf(stderr, "avx2 is not supported by this CPU\n");
+			exit(1);
+		}
+		return &replay_avx2_kernels;
+	}
+#endif
+	fprintf(stderr, "unknown kernels %s\n", name);
+	exit(1);
+}
+
+/* the range checks of the sysfs attributes */
+static unsigned int replay_option(const char *arg, unsigned int lo,
+				  unsigned int hi)
+{
+	char *end;
+	unsigned long val = strtoul(arg, &end, 0);
+
+	if (*end || val < lo || val > hi) {
+		fprintf(stderr, "%s is not within %u..%u\n", arg, lo, hi);
+		exit(2);
+	}
+	return val;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] [recording|-]\n"
+		"  -b N      benchmark the stages over N passes\n"
+		"  -g N      use N synthetic frames instead of a recording\n"
+		"  -f N      fingers of the synthetic frames (default 2)\n"
+		"  -z N      noise of the synthetic frames, in counts (default 3)\n"
+		"  -s RATE   stress: score the frames RATE times a second\n"
+		"  -P N      panels scored in parallel while stressing (default 1)\n"
+		"  -d N      seconds to stress for (default 5)\n"
+		"  -i FILE   stress: write to a debugfs inject file, once per panel\n"
+		"  -w FILE   write the frames used to FILE\n"
+		"  -k NAME   scoring kernels: scalar"
+#ifdef SKEL_HAVE_SIMD
+		", sse2, avx2"
+#endif
+		"\n"
+		"  -R        score the whole frame (roi=N)\n"
+		"  -p        parabolic peak positions (peak_fit=Y)\n"
+		"  -C        no baseline tracking (continuous_calibration=N)\n"
+		"  -t N      sigma_threshold\n"
+		"  -n N      calibration_frames\n"
+		"  -l N      line_offset\n"
+		"  -m N      max_contacts\n"
+		"  -q        only print the summary\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = 0, iterations = 0, fingers = 2, noise = 3;
+	unsigned int rate = 0, panels = 0, seconds = 5, injects = 0;
+	const char *out = NULL;
+	char **inject = NULL;
+	unsigned char *frames;
+	struct replay r;
+	bool quiet = false;
+	FILE *file;
+	int opt;
+
+	replay_init(&r);
+
+	while ((opt = getopt(argc, argv, "b:g:f:z:s:P:d:i:w:k:RpCt:n:l:m:qh")) != -1) {
+		switch (opt) {
+		case 'b':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fingers = replay_option(optarg, 0, 16);
+			break;
+		case 'z':
+			noise = replay_option(optarg, 0, 30);
+			break;
+		case 's':
+			rate = replay_option(optarg, 1, 100000);
+			break;
+		case 'P':
+			panels = replay_option(optarg, 1, 1024);
+			break;
+		case 'd':
+			seconds = replay_option(optarg, 1, 3600);
+			break;
+		case 'i':
+			inject = realloc(inject, ++injects * sizeof(*inject));
+			if (!inject) {
+				perror("realloc");
+				return 1;
+			}
+			inject[injects - 1] = optarg;
+			break;
+		case 'w':
+			out = optarg;
+			break;
+		case 'k':
+			r.kernels = replay_kernels(optarg);
+			break;
+		case 'R':
+			r.options.roi = false;
+			break;
+		case 'p':
+			r.options.peak_fit = true;
+			break;
+		case 'C':
+			r.options.continuous = false;
+			break;
+		case 't':
+			r.options.threshold = replay_option(optarg, 1, U16_MAX);
+			break;
+		case 'n':
+			r.options.calibration_frames =
+				replay_option(optarg, 2, U16_MAX);
+			break;
+		case 'l':
+			r.options.line_offset =
+				replay_option(optarg, 0, FRAME_ROWS - 1);
+			break;
+		case 'm':
+			r.options.max_contacts =
+				replay_option(optarg, 1, MAX_CONTACTS);
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (n) {
+		if (optind != argc)
+			usage(argv[0]);
+		frames = replay_plane(n, FRAME_SIZE);
+		replay_generate(frames, n, r.options.calibration_frames,
+				fingers, noise);
+	} else {
+		if (optind != argc - 1)
+			usage(argv[0]);
+		frames = replay_load(argv[optind], &n);
+	}
+	if (!n) {
+		fprintf(stderr, "no frames\n");
+		return 1;
+	}
+
+	if (out) {
+		file = fopen(out, "wb");
+		if (!file || fwrite(frames, FRAME_SIZE, n, file) != n ||
+		    fclose(file)) {
+			fprintf(stderr, "%s: %s\n", out, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (injects && panels && panels != injects) {
+		fprintf(stderr, "-P does not match the -i files\n");
+		return 2;
+	}
+	if (injects)
+		panels = injects;
+	if (rate)
+		replay_stress(&r, frames, n, rate, max(panels, 1U), seconds,
+			      inject);
+	else if (iterations)
+		replay_bench(&r, frames, n, iterations);
+	else
+		replay_run(&r, frames, n, quiet);
+
+	return 0;
+}
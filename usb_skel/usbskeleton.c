@@ -21,9 +21,34 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
-#include <linux/input-polldev.h>
+#include <linux/input.h>
 #include <linux/usb/input.h>
 #include <linux/input/mt.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/firmware.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/gcd.h>
+
+#ifdef SKEL_HAVE_SIMD
+#include <asm/simd.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#else
+#include <asm/neon.h>
+#endif
+#endif
+
+#include "usbskeleton_pipeline.h"
+#include "usbskeleton_capture.h"
+
+#define CREATE_TRACE_POINTS
+#include "usbskeleton_trace.h"
 
 MODULE_AUTHOR("Benoit Juin <benoit@aeon-creation.com>");
 MODULE_DESCRIPTION("GreenTouch touch foil device driver");
@@ -34,18 +59,26 @@ MODULE_LICENSE("GPL");
 #define USB_SKEL_VENDOR_ID	0x0547
 #define USB_SKEL_PRODUCT_ID	0x2001 
 
-#define POLL_INTERVAL 10
+/* idle mode: frames without contact before slowing down, and ms between frames */
+#define IDLE_AFTER 500
+#define IDLE_INTERVAL 100
+/* upper bound of the idle_interval attribute, in ms */
+#define IDLE_INTERVAL_MAX 1000
 #define NAME_LONG "GreenTouch MT" 
 
-/* sensor resolution */
-#define SENSOR_RES_X 1920
-#define SENSOR_RES_Y 1080
-#define MAX_CONTACTS 10
-#define SIGMA_THRESHOLD 275
-#define SIGMA_COMPUTE_FRAME 255
-#define AVERAGE_COMPUTE_FRAME 255
-#define CALIBRATE_EVERY 7000
-#define BLOB_LINE_OFFSET 0
+/* farthest a contact may move between frames and keep its tracking id */
+#define TRACK_DMAX (SENSOR_RES_X/8)
+/*
+ * motion prediction: ms reported positions lead by (0 off) and alpha-beta
+ * gains in 1/256, see skel_predict()
+ */
+#define PREDICT_HORIZON 0
+#define PREDICT_ALPHA 128
+#define PREDICT_BETA 32
+/* upper bound of the predict_horizon attribute, in ms */
+#define PREDICT_HORIZON_MAX 50
+/* a contact unseen for longer starts at rest again */
+#define PREDICT_GAP_NS (50 * NSEC_PER_MSEC)
 
 /* table of devices that work with this driver */
 static const struct usb_device_id skel_table[] = {
@@ -65,12 +98,181 @@ MODULE_DEVICE_TABLE(usb, skel_table);
    is an integer 512 is the largest possible packet on EHCI */
 #define WRITES_IN_FLIGHT	8
 /* arbitrarily chosen */
-struct touch_contact {
-  int x;
-  int y;
-  int h;
-  int w;
-  bool processed;
+#define READS_IN_FLIGHT		4
+/* frame reads kept queued on the bulk in endpoint while streaming */
+#define FRAME_RING_MAX		32
+/* upper bound for the ring_depth parameter */
+#define FRAMES_PER_URB_MAX	16
+/* upper bound for the frames_per_urb parameter */
+#define ERROR_BACKOFF_MAX	1000
+/* most ms before a failing frame urb is resubmitted */
+#define CAPTURE_FRAMES_MAX	1024
+/* upper bound for the capture_frames parameter */
+#define CAPTURE_HEADER_SIZE	PAGE_SIZE
+#define CAPTURE_STRIDE		ALIGN(sizeof(struct greentouch_capture_frame), 64)
+#define COMMAND_TIMEOUT		1000
+/* ms a sensor command may take on the bulk out endpoint */
+#define SCAN_RATE_MAX		1000
+/* upper bound for the scan_rate attribute, in frames per second */
+
+static unsigned int ring_depth = 8;
+module_param(ring_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_depth, "Frame slots per device, at least READS_IN_FLIGHT + 2 (default 8)");
+
+static unsigned int frames_per_urb = 1;
+module_param(frames_per_urb, uint, S_IRUGO);
+MODULE_PARM_DESC(frames_per_urb, "Frames each bulk in transfer may carry, rounded up to whole packets (default 1)");
+
+static bool peak_fit;
+module_param(peak_fit, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(peak_fit, "Position contacts with a parabolic fit around their peak cell instead of the centroid (default N)");
+
+static bool roi_enable = true;
+module_param_named(roi, roi_enable, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(roi, "Only score the active tiles of the sensor and their neighbours (default Y)");
+
+static bool continuous_calibration = true;
+module_param(continuous_calibration, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(continuous_calibration, "Track the baseline while scoring instead of recalibrating every calibrate_every frames (default Y)");
+
+static unsigned int capture_frames = 64;
+module_param(capture_frames, uint, S_IRUGO);
+MODULE_PARM_DESC(capture_frames, "Records of the mmap'ed capture ring of the character device (default 64)");
+
+static bool capture_scores;
+module_param(capture_scores, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(capture_scores, "Also capture the smoothed score plane of each frame (default N)");
+
+/*
+ * Calibration snapshot, as read from and written to the calibration
+ * attribute and loaded from greentouch/<serial>.cal at probe. All fields
+ * are little endian, planes are indexed like the frame (FRAME_INDEX).
+ */
+#define SKEL_CALIBRATION_MAGIC		0x43544724	/* "$GTC" */
+#define SKEL_CALIBRATION_VERSION	1
+
+struct skel_calibration {
+	__le32			magic;
+	__le16			version;
+	__le16			cells;			/* FRAME_CELLS */
+	__le16			average_q8[FRAME_CELLS];	/* baseline, 1/256 units */
+	__le16			sigma_q8[FRAME_CELLS];	/* noise estimate, 1/256 units */
+} __packed;
+
+/*
+ * Latency of the frame pipeline, from the end of the transfer to the
+ * input_sync() reporting it. Histogram bucket b counts samples under
+ * 2^b microseconds, the last one everything above.
+ */
+#define LATENCY_BUCKETS	16
+
+enum skel_stage {
+	SKEL_STAGE_QUEUE,	/* transfer completion to processing */
+	SKEL_STAGE_SCORE,	/* calibration, scoring, box filter */
+	SKEL_STAGE_LABEL,	/* labelling and positions */
+	SKEL_STAGE_REPORT,	/* slots, events and input_sync() */
+	SKEL_STAGE_TOTAL,	/* transfer completion to input_sync() */
+	SKEL_STAGES
+};
+
+static const char * const skel_stage_names[SKEL_STAGES] = {
+	[SKEL_STAGE_QUEUE] = "queue",
+	[SKEL_STAGE_SCORE] = "score",
+	[SKEL_STAGE_LABEL] = "label",
+	[SKEL_STAGE_REPORT] = "report",
+	[SKEL_STAGE_TOTAL] = "total",
+};
+
+struct skel_latency {
+	unsigned long		count;
+	u64			total_ns;
+	u64			max_ns;
+	u32			buckets[LATENCY_BUCKETS];
+};
+
+/*
+ * Monitoring counters, shown in the stats directory of the interface.
+ * Each half has a single writer. Readers do not lock, u64_stats_sync
+ * gives them consistent 64 bit values on 32 bit machines.
+ */
+struct skel_stats {
+	/* written by the urb completion and the inject hook, under err_lock */
+	struct u64_stats_sync	rx_syncp;
+	u64			transfers;		/* transfers carrying frames */
+	u64			frames_received;	/* complete frames of those */
+	u64			short_transfers;	/* transfers not ending on a frame */
+	u64			transfer_errors;	/* urbs completed with an error */
+	u64			frames_injected;	/* frames written to debugfs inject */
+
+	/* written by skel_process_frame() */
+	struct u64_stats_sync	frame_syncp;
+	u64			idle_entries;		/* switches to the idle mode */
+	u64			active_ns;		/* time streaming at the full rate */
+	u64			idle_ns;		/* time streaming at the idle rate */
+	u64			frames_processed;
+	u64			calibration_frames;	/* frames taken by the calibration */
+	u64			contacts;		/* contacts of all scored frames */
+	u64			contacts_max;		/* most contacts in one frame */
+	u64			score_total;		/* smoothed scores, all cells and frames */
+	u64			score_peak;		/* highest smoothed score */
+	u64			process_ns;		/* time spent processing frames */
+	u64			predictions;		/* predicted positions checked */
+	u64			predict_error_total;	/* their distance to the contact */
+	u64			predict_error_max;
+};
+
+/*
+ * Frame lines and columns the sensor scans, see SKEL_CMD_SCAN_WINDOW.
+ * The whole frame is still transferred, cells outside read as noise.
+ */
+struct skel_scan_window {
+	u8			line;			/* first frame line */
+	u8			column;			/* first column */
+	u8			lines;
+	u8			columns;
+};
+
+/*
+ * Detection parameters of a device, see the attributes of the same
+ * names. Written ones are staged in params_next and taken by the next
+ * frame.
+ */
+struct skel_params {
+	unsigned int		sigma_threshold;	/* smoothed score of a touched cell */
+	unsigned int		calibration_frames;	/* frames averaged by the calibration */
+	unsigned int		calibrate_every;	/* frames between two calibrations */
+	unsigned int		line_offset;		/* frame line shown as row 0 */
+	unsigned int		max_contacts;		/* contacts reported per frame */
+	unsigned int		idle_after;		/* quiet frames before idling, 0 never */
+	unsigned int		idle_interval;		/* ms between frames while idle */
+	struct skel_scan_window	window;			/* area the sensor scans */
+	unsigned int		predict_horizon;	/* ms positions lead by, 0 off */
+	unsigned int		predict_alpha;		/* position gain, in 1/256 */
+	unsigned int		predict_beta;		/* velocity gain, in 1/256 */
+};
+
+/*
+ * Motion of the contact in an input slot. Positions are in 1/256 sensor
+ * unit, velocities in 1/256 sensor unit per ms.
+ */
+struct skel_track {
+	u32			seq;			/* report that last updated it */
+	int			tracking_id;		/* of the contact it follows */
+	u64			timestamp;		/* of that frame */
+	s32			x, y;			/* filtered position */
+	s32			vx, vy;
+	int			seen_x, seen_y;		/* measured position, sensor units */
+	bool			pending;		/* a prediction awaits its time */
+	u64			target_ns;		/* time it was made for */
+	int			predicted_x, predicted_y;
+};
+
+/* one DMA-coherent frame buffer of the acquisition ring */
+struct frame_slot {
+	unsigned char		*data;
+	dma_addr_t		dma;
+	u64			timestamp;		/* ktime_get_ns() at completion */
+	unsigned int		frames;			/* complete frames in data */
 };
 
 
@@ -79,52 +281,224 @@ struct usb_skel {
 	struct usb_device	*udev;			/* the usb device for this device */
 	struct usb_interface	*interface;		/* the interface for this device */
 	struct semaphore	limit_sem;		/* limiting the number of writes in progress */
-	struct usb_anchor	submitted;		/* in case we need to retract our submissions */
-	struct urb		*bulk_in_urb;		/* the urb to read data with */
-	unsigned char           *bulk_in_buffer;	/* the buffer to receive data */
-        unsigned short          *score_frame;	        /* store the first frame */
-        unsigned short          *score_frame_adjacent;	        /* store the first frame */
-        unsigned short          *score_last_frame_adjacent;	        /* store the first frame */
-    	unsigned short          *sigma_frame;/* store the first frame */
-        unsigned short          *average_frame;	        /* store the first frame */
-	bool			sigma_normalized;	/* a read is going on */
-        bool			average_computed;
+	struct usb_anchor	submitted;		/* write urbs, in case we need to retract them */
+	struct urb		*frame_urbs[READS_IN_FLIGHT];	/* urbs streaming frames from the sensor */
+	u8			urb_slot[READS_IN_FLIGHT];	/* ring slot each frame urb fills */
+	struct frame_slot	*ring;			/* preallocated frame slots */
+	unsigned int		ring_depth;		/* number of slots in ring */
+	unsigned int		frames_per_urb;		/* frames a slot holds */
+	u8			ready[FRAME_RING_MAX];	/* filled slots, oldest first */
+	u8			free_slots[FRAME_RING_MAX];	/* slots nobody uses */
+	unsigned int		ready_head;		/* oldest entry of ready */
+	unsigned int		ready_count;		/* entries queued in ready */
+	unsigned int		free_count;		/* entries in free_slots */
+	int			busy_slot;		/* slot normalize() reads, -1 if none */
+	unsigned long		ring_overruns;		/* slots recycled before being processed */
+	bool			streaming;		/* frame urbs are resubmitted on completion */
+	bool			idle;			/* one frame per idle_interval, under err_lock */
+	unsigned long		parked;			/* frame urbs held back while idle */
+	unsigned long		failed;			/* frame urbs waiting for recover_work */
+	bool			halted;			/* the bulk in endpoint stalled */
+	bool			recovering;		/* recover_work is clearing the halt */
+	unsigned int		rx_errors;		/* frame transfers failed in a row */
+	unsigned int		quiet_frames;		/* frames since the last touched one */
+	u64			mode_since;		/* end of the last time accounting */
+	bool			input_opened;		/* the input device is opened by someone */
+	struct skel_planes	*planes;		/* scores, baseline and calibration sums */
+        unsigned short          *score_frame_adjacent;	        /* one of planes->adjacent */
+        unsigned short          *score_last_frame_adjacent;	        /* previous frame, swapped with score_frame_adjacent */
+	const struct skel_kernels *kernels;		/* per-cell kernels in use */
+	bool			force_scalar;		/* never use the vector kernels */
+	struct dentry		*debugfs;		/* our debugfs directory */
+	bool			calibrated;		/* average and sigma are known */
+	struct mutex		calibration_mutex;	/* serializes the calibration attribute */
+	struct skel_calibration	*calibration_snapshot;	/* snapshot being read */
+	struct skel_calibration	*calibration_io;	/* snapshot being written */
+	struct skel_calibration	*calibration_pending;	/* restored by the next frame */
+	struct skel_params	params;			/* in use by the frame processing */
+	struct skel_params	params_next;		/* written ones, under err_lock */
+	bool			params_dirty;		/* params_next awaits the next frame */
+	u64			window_tiles;		/* ROI tiles params.window covers */
+	unsigned int		scan_rate;		/* frames per second, 0 firmware default */
+	bool			commands_unsupported;	/* the firmware stalled a command */
         int                     frame_index;
 	size_t			bulk_in_size;		/* the size of the receive buffer */
-	size_t			bulk_in_filled;		/* number of bytes in the buffer */
-	size_t			bulk_in_copied;		/* already copied to user space */
 	__u8			bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
 	__u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
 	int			errors;			/* the last request tanked */
-	bool			ongoing_read;		/* a read is going on */
   
 	spinlock_t		err_lock;		/* lock for errors */
 	struct kref		kref;
 	struct mutex		io_mutex;		/* synchronize I/O with disconnect */
-	wait_queue_head_t	bulk_in_wait;		/* to wait for an ongoing read */
+	struct greentouch_capture_header *capture;	/* mmap'ed capture ring */
+	unsigned int		capture_frames;		/* records in capture */
+	u32			capture_head;		/* number of the next captured frame */
+	unsigned int		capture_users;		/* opened character devices */
+	wait_queue_head_t	capture_wait;		/* to wait for a captured frame */
         char phys[64];
-        struct input_polled_dev *input;
+        struct input_dev *input;
+	struct workqueue_struct	*wq;			/* runs the frame processing of this device */
+	struct work_struct	frame_work;		/* drains the ready frames */
+	struct delayed_work	idle_work;		/* asks for the next frame while idle */
+	struct delayed_work	recover_work;		/* resubmits failed frame urbs */
         struct touch_contact touch_contacts[MAX_CONTACTS];
+	struct blob_label	*labels;		/* MAX_LABELS labeller entries */
+	struct skel_roi		roi;
+	struct skel_latency	latency[SKEL_STAGES];	/* written by the frame processing */
+	struct skel_stats	stats;
+	struct input_mt_pos	contact_pos[MAX_CONTACTS];	/* reported position of each contact */
+	int			contact_slots[MAX_CONTACTS];	/* slot assigned to each contact */
+	struct skel_track	tracks[MAX_CONTACTS];	/* motion of each slot */
+	u32			report_seq;		/* frames reported so far */
 };
 #define to_skel_dev(d) container_of(d, struct usb_skel, kref)
 
+/* an opened character device */
+struct skel_file {
+	struct usb_skel		*dev;
+	u32			seen;			/* capture head when poll() last reported it */
+};
+
 static struct usb_driver skel_driver;
 static void skel_draw_down(struct usb_skel *dev);
+static const struct skel_kernels *skel_pick_kernels(bool force_scalar);
 
 static void skel_delete(struct kref *kref)
 {
 	struct usb_skel *dev = to_skel_dev(kref);
+	int i;
 
-	usb_free_urb(dev->bulk_in_urb);
+	for (i = 0; i < READS_IN_FLIGHT; i++)
+		usb_free_urb(dev->frame_urbs[i]);
+	if (dev->ring) {
+		for (i = 0; i < dev->ring_depth; i++)
+			if (dev->ring[i].data)
+				usb_free_coherent(dev->udev, dev->bulk_in_size,
+						  dev->ring[i].data,
+						  dev->ring[i].dma);
+		kfree(dev->ring);
+	}
+	if (dev->wq)
+		destroy_workqueue(dev->wq);
 	usb_put_dev(dev->udev);
-	kfree(dev->bulk_in_buffer);
+	vfree(dev->capture);
+	kfree(dev->labels);
+	kvfree(dev->planes);
+	kfree(dev->calibration_snapshot);
+	kfree(dev->calibration_io);
+	kfree(dev->calibration_pending);
 	kfree(dev);
 }
 
+/*
+ * Raw capture: every processed frame is copied once into a vmalloc'ed
+ * ring that readers of the character device mmap, see
+ * usbskeleton_capture.h. The buffer is allocated by the first open and
+ * lives as long as the device.
+ */
+static unsigned int skel_capture_size(unsigned int nr_frames)
+{
+	return PAGE_ALIGN(CAPTURE_HEADER_SIZE + nr_frames * CAPTURE_STRIDE);
+}
+
+static int skel_capture_alloc(struct usb_skel *dev)
+{
+	struct greentouch_capture_header *header;
+
+	dev->capture_frames = clamp_t(unsigned int, capture_frames, 2,
+				      CAPTURE_FRAMES_MAX);
+	header = vmalloc_user(skel_capture_size(dev->capture_frames));
+	if (!header)
+		return -ENOMEM;
+
+	header->magic = GREENTOUCH_CAPTURE_MAGIC;
+	header->version = GREENTOUCH_CAPTURE_VERSION;
+	header->header_size = CAPTURE_HEADER_SIZE;
+	header->frame_stride = CAPTURE_STRIDE;
+	header->nr_frames = dev->capture_frames;
+	header->rows = FRAME_ROWS;
+	header->cols = FRAME_COLS;
+	/* the frame processing may pick it up as soon as it is set */
+	smp_store_release(&dev->capture, header);
+
+	return 0;
+}
+
+/*
+ * called by the frame processing, after the smoothed scores are swapped in,
+ * with the @capture ring it loaded from dev->capture
+ */
+static void skel_capture_frame(struct usb_skel *dev,
+			       struct greentouch_capture_header *capture,
+			       const unsigned char *frame, u64 timestamp)
+{
+	struct greentouch_capture_frame *record;
+	u32 seq = dev->capture_head;
+	int i;
+
+	record = (void *)capture + CAPTURE_HEADER_SIZE +
+		(seq % dev->capture_frames) * CAPTURE_STRIDE;
+
+	WRITE_ONCE(record->sequence, GREENTOUCH_CAPTURE_BUSY);
+	smp_wmb();
+	record->timestamp_ns = timestamp;
+	record->flags = 0;
+	for (i = 0; i < FRAME_ROWS; i++)
+		memcpy(record->raw + i * FRAME_COLS,
+		       frame + FRAME_INDEX(i, 0, dev->params.line_offset),
+		       FRAME_COLS);
+	if (dev->calibrated && READ_ONCE(capture_scores)) {
+		memcpy(record->score, dev->score_last_frame_adjacent,
+		       sizeof(record->score));
+		record->flags |= GREENTOUCH_CAPTURE_SCORES;
+	}
+	smp_wmb();
+	WRITE_ONCE(record->sequence, seq);
+
+	/* never hits GREENTOUCH_CAPTURE_BUSY in practice: 497 days at 100 Hz */
+	dev->capture_head = seq + 1;
+	smp_store_release(&capture->head, seq + 1);
+	wake_up_interruptible(&dev->capture_wait);
+}
+
+static unsigned int skel_capture_poll(struct file *file, poll_table *wait)
+{
+	struct skel_file *reader = file->private_data;
+	struct usb_skel *dev = reader->dev;
+	unsigned int mask = 0;
+	u32 head;
+
+	poll_wait(file, &dev->capture_wait, wait);
+
+	if (!READ_ONCE(dev->interface))
+		return POLLERR | POLLHUP;
+
+	head = smp_load_acquire(&dev->capture->head);
+	if (head != reader->seen) {
+		reader->seen = head;
+		mask |= POLLIN | POLLRDNORM;
+	}
+
+	return mask;
+}
+
+static int skel_capture_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct skel_file *reader = file->private_data;
+
+	/* the ring is written by the driver only */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, reader->dev->capture, vma->vm_pgoff);
+}
+
 static int skel_open(struct inode *inode, struct file *file)
 {
 	struct usb_skel *dev;
 	struct usb_interface *interface;
+	struct skel_file *reader;
 	int subminor;
 	int retval = 0;
 
@@ -144,15 +518,40 @@ static int skel_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	mutex_lock(&dev->io_mutex);
+	if (!dev->capture)
+		retval = skel_capture_alloc(dev);
+	if (!retval) {
+		dev->capture_users++;
+		reader->seen = dev->capture_head;
+	}
+	mutex_unlock(&dev->io_mutex);
+	if (retval) {
+		kfree(reader);
+		goto exit;
+	}
+
 	retval = usb_autopm_get_interface(interface);
-	if (retval)
+	if (retval) {
+		mutex_lock(&dev->io_mutex);
+		dev->capture_users--;
+		mutex_unlock(&dev->io_mutex);
+		kfree(reader);
 		goto exit;
+	}
 
 	/* increment our usage count for the device */
 	kref_get(&dev->kref);
 
 	/* save our object in the file's private structure */
-	file->private_data = dev;
+	reader->dev = dev;
+	file->private_data = reader;
 
 exit:
 	return retval;
@@ -160,14 +559,17 @@ exit:
 
 static int skel_release(struct inode *inode, struct file *file)
 {
+	struct skel_file *reader = file->private_data;
 	struct usb_skel *dev;
 
-	dev = file->private_data;
-	if (dev == NULL)
+	if (reader == NULL)
 		return -ENODEV;
+	dev = reader->dev;
+	kfree(reader);
 
 	/* allow the device to be autosuspended */
 	mutex_lock(&dev->io_mutex);
+	dev->capture_users--;
 	if (dev->interface)
 		usb_autopm_put_interface(dev->interface);
 	mutex_unlock(&dev->io_mutex);
@@ -179,12 +581,13 @@ static int skel_release(struct inode *inode, struct file *file)
 
 static int skel_flush(struct file *file, fl_owner_t id)
 {
+	struct skel_file *reader = file->private_data;
 	struct usb_skel *dev;
 	int res;
 
-	dev = file->private_data;
-	if (dev == NULL)
+	if (reader == NULL)
 		return -ENODEV;
+	dev = reader->dev;
 
 	/* wait for io to stop */
 	mutex_lock(&dev->io_mutex);
@@ -201,189 +604,12 @@ static int skel_flush(struct file *file, fl_owner_t id)
 	return res;
 }
 
-static void skel_read_bulk_callback(struct urb *urb)
-{
-	struct usb_skel *dev;
-	printk("%s\n", __func__);
-	dev = urb->context;
-
-	spin_lock(&dev->err_lock);
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
-			dev_err(&dev->interface->dev,
-				"%s - nonzero write bulk status received: %d\n",
-				__func__, urb->status);
-
-		dev->errors = urb->status;
-	} else {
-		dev->bulk_in_filled = urb->actual_length;
-	}
-	dev->ongoing_read = 0;
-	spin_unlock(&dev->err_lock);
-
-	wake_up_interruptible(&dev->bulk_in_wait);
-}
-
-static int skel_do_read_io(struct usb_skel *dev, size_t count)
-{
-	int rv;
-	
-  	printk("%s\n", __func__);
-	/* prepare a read */
-	usb_fill_bulk_urb(dev->bulk_in_urb,
-			dev->udev,
-			usb_rcvbulkpipe(dev->udev,
-				dev->bulk_in_endpointAddr),
-			dev->bulk_in_buffer,
-			min(dev->bulk_in_size, count),
-			skel_read_bulk_callback,
-			dev);
-	/* tell everybody to leave the URB alone */
-	spin_lock_irq(&dev->err_lock);
-	dev->ongoing_read = 1;
-	spin_unlock_irq(&dev->err_lock);
-
-	/* submit bulk in urb, which means no data to deliver */
-	dev->bulk_in_filled = 0;
-	dev->bulk_in_copied = 0;
-
-	/* do it */
-	rv = usb_submit_urb(dev->bulk_in_urb, GFP_KERNEL);
-	if (rv < 0) {
-		dev_err(&dev->interface->dev,
-			"%s - failed submitting read urb, error %d\n",
-			__func__, rv);
-		rv = (rv == -ENOMEM) ? rv : -EIO;
-		spin_lock_irq(&dev->err_lock);
-		dev->ongoing_read = 0;
-		spin_unlock_irq(&dev->err_lock);
-	}
-
-	return rv;
-}
-
-static ssize_t skel_read(struct file *file, char *buffer, size_t count,
-			 loff_t *ppos)
-{
-	struct usb_skel *dev;
-	int rv;
-	bool ongoing_io;
-
-	dev = file->private_data;
-
-  	printk("%s\n", __func__);
-	
-	/* if we cannot read at all, return EOF */
-	if (!dev->bulk_in_urb || !count)
-		return 0;
-
-	/* no concurrent readers */
-	rv = mutex_lock_interruptible(&dev->io_mutex);
-	if (rv < 0)
-		return rv;
-
-	if (!dev->interface) {		/* disconnect() was called */
-		rv = -ENODEV;
-		goto exit;
-	}
-
-	/* if IO is under way, we must not touch things */
-retry:
-	spin_lock_irq(&dev->err_lock);
-	ongoing_io = dev->ongoing_read;
-	spin_unlock_irq(&dev->err_lock);
-
-	if (ongoing_io) {
-		/* nonblocking IO shall not wait */
-		if (file->f_flags & O_NONBLOCK) {
-			rv = -EAGAIN;
-			goto exit;
-		}
-		/*
-		 * IO may take forever
-		 * hence wait in an interruptible state
-		 */
-		rv = wait_event_interruptible(dev->bulk_in_wait, (!dev->ongoing_read));
-		if (rv < 0)
-			goto exit;
-	}
-
-	/* errors must be reported */
-	rv = dev->errors;
-	if (rv < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		rv = (rv == -EPIPE) ? rv : -EIO;
-		/* report it */
-		goto exit;
-	}
-
-	/*
-	 * if the buffer is filled we may satisfy the read
-	 * else we need to start IO
-	 */
-
-	if (dev->bulk_in_filled) {
-		/* we had read data */
-		size_t available = dev->bulk_in_filled - dev->bulk_in_copied;
-		size_t chunk = min(available, count);
-
-		if (!available) {
-			/*
-			 * all data has been used
-			 * actual IO needs to be done
-			 */
-			rv = skel_do_read_io(dev, count);
-			if (rv < 0)
-				goto exit;
-			else
-				goto retry;
-		}
-		/*
-		 * data is available
-		 * chunk tells us how much shall be copied
-		 */
-
-		if (copy_to_user(buffer,
-				 dev->bulk_in_buffer + dev->bulk_in_copied,
-				 chunk))
-			rv = -EFAULT;
-		else
-			rv = chunk;
-
-		dev->bulk_in_copied += chunk;
-
-		/*
-		 * if we are asked for more than we have,
-		 * we start IO but don't wait
-		 */
-		if (available < count)
-			skel_do_read_io(dev, count - chunk);
-	} else {
-		/* no data in the buffer */
-		rv = skel_do_read_io(dev, count);
-		if (rv < 0)
-			goto exit;
-		else
-			goto retry;
-	}
-exit:
-	mutex_unlock(&dev->io_mutex);
-	return rv;
-}
-
 static void skel_write_bulk_callback(struct urb *urb)
 {
 	struct usb_skel *dev;
 
 	dev = urb->context;
 
-	printk("%s\n", __func__);
-
 	/* sync/async unlink faults aren't errors */
 	if (urb->status) {
 		if (!(urb->status == -ENOENT ||
@@ -413,9 +639,7 @@ static ssize_t skel_write(struct file *file, const char *user_buffer,
 	char *buf = NULL;
 	size_t writesize = min(count, (size_t)MAX_TRANSFER);
 
-	dev = file->private_data;
-
-	printk("%s\n", __func__);
+	dev = ((struct skel_file *)file->private_data)->dev;
 
 	/* verify that we actually have some data to write */
 	if (count == 0)
@@ -517,8 +741,9 @@ exit:
 
 static const struct file_operations skel_fops = {
 	.owner =	THIS_MODULE,
-	.read =		skel_read,
 	.write =	skel_write,
+	.poll =		skel_capture_poll,
+	.mmap =		skel_capture_mmap,
 	.open =		skel_open,
 	.release =	skel_release,
 	.flush =	skel_flush,
@@ -536,263 +761,1724 @@ static struct usb_class_driver skel_class = {
 };
 
 
+/*
+ * Sensor commands, sent on the bulk out endpoint: an opcode, the payload
+ * length and the payload, little endian. Firmware without a command
+ * channel stalls the endpoint; the first stall marks commands as
+ * unsupported for the device. Commands are sent with io_mutex held and
+ * sent again after a reset, which returns the sensor to its defaults.
+ */
+#define SKEL_CMD_SCAN_RATE	0x01	/* __le16 frames per second, 0 default */
+#define SKEL_CMD_SCAN_WINDOW	0x02	/* struct skel_scan_window */
+#define SKEL_CMD_PAYLOAD_MAX	4
+
+struct skel_command {
+	u8			opcode;
+	u8			length;
+	u8			payload[SKEL_CMD_PAYLOAD_MAX];
+} __packed;
+
+static int skel_send_command(struct usb_skel *dev, u8 opcode,
+			     const void *payload, u8 length)
+{
+	unsigned int pipe = usb_sndbulkpipe(dev->udev,
+					    dev->bulk_out_endpointAddr);
+	struct skel_command *cmd;
+	int actual, retval;
 
-void debug_matrix(unsigned short* score_frame,unsigned short* score_frame_adjacent){
-  int i,j;
-  printk("################################################################\n");
-  for(i=0; i<64; i++){
-    printk("%2d",i);
-    for(j=0; j<64;j++){
-
-      int index = j+64*i+64+64*BLOB_LINE_OFFSET;
-      int score = score_frame_adjacent[index];
-      index = index%4096;
-      //int score = score_frame[index];
-      if(score <= 180)
-	printk("  ");
-      else if(score/10 > 99)
-	printk("XX");
-      else
-	printk("%02d",score/10);
-	//printk("00");
-    }
-    printk("\n");
-  }
-  printk("\n");
+	if (!dev->interface)		/* disconnect() was called */
+		return -ENODEV;
+	if (dev->commands_unsupported)
+		return -EOPNOTSUPP;
+
+	/* the buffer is mapped for DMA, it cannot live on the stack */
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd)
+		return -ENOMEM;
+	cmd->opcode = opcode;
+	cmd->length = length;
+	memcpy(cmd->payload, payload, length);
+
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval)
+		goto exit;
+	retval = usb_bulk_msg(dev->udev, pipe, cmd,
+			      offsetof(struct skel_command, payload) + length,
+			      &actual, COMMAND_TIMEOUT);
+	if (retval == -EPIPE) {
+		usb_clear_halt(dev->udev, pipe);
+		dev->commands_unsupported = true;
+		dev_info(&dev->interface->dev,
+			 "firmware does not take sensor commands\n");
+		retval = -EOPNOTSUPP;
+	} else if (retval) {
+		dev_err(&dev->interface->dev,
+			"%s - command %#x failed: %d\n",
+			__func__, opcode, retval);
+	}
+	usb_autopm_put_interface(dev->interface);
+
+exit:
+	kfree(cmd);
+	return retval;
 }
 
+/* scan @rate frames per second, 0 for the firmware default */
+static int skel_set_scan_rate(struct usb_skel *dev, unsigned int rate)
+{
+	__le16 payload = cpu_to_le16(rate);
+	int retval;
 
+	retval = skel_send_command(dev, SKEL_CMD_SCAN_RATE, &payload,
+				   sizeof(payload));
+	if (!retval)
+		dev->scan_rate = rate;
+	return retval;
+}
 
-/* There is an offset of 96 bits
-   Stage 1: get average on n = AVERAGE_COMPUTE_FRAME frames
-   Stage 2: compute sigma on n = SIGMA_COMPUTE_FRAME frames
- */
-static int normalize(unsigned char *current_frame,
-		     unsigned short *score_frame,
-		     unsigned short *score_frame_adjacent,
-		     unsigned short *score_last_frame_adjacent,
-		     unsigned short *average_frame,
-		     unsigned short *sigma_frame,
-		     int frame_index,
-		     bool sigma_normalized,
-		     bool average_computed,
-		     struct touch_contact *touch_contacts){
-  int retval, i, j, k, l,m, adj_index, index, contact_index, contact_match_index;
-  bool cell_triggered;
-  
-  unsigned short sigma_threshold_factor;
-  unsigned short sigma;
-  unsigned short score;
-  unsigned short current_value;
-  unsigned short difference;
-  struct touch_contact *contact;
-  
-  sigma_threshold_factor = SIGMA_THRESHOLD;
-  contact_index = 0;
-  retval = 0;
+/* only scan @window, the next frame restricts the ROI to it */
+static int skel_set_scan_window(struct usb_skel *dev,
+				const struct skel_scan_window *window)
+{
+	int retval;
 
-  
-  for(i=0;i<64;i++){
-    for(j=0;j<64;j++){
-      index = j+i*64+64+64*BLOB_LINE_OFFSET;
-      index = index%4096;
-      if(!average_computed && frame_index < AVERAGE_COMPUTE_FRAME){
-	if (frame_index == 0)
-	  average_frame[index] = current_frame[index];
-	else
-	  average_frame[index] += current_frame[index];
-	
-	if(average_frame[index] > 65000){
-	  printk("average is high %d %d %d %d\n", i, j, index, average_frame[index]);
-	}
-      }else if(!average_computed && frame_index == AVERAGE_COMPUTE_FRAME){
-	//printk("average_computed %d %d %d %02X\n", i, j, index, value);
-	average_frame[index] = average_frame[index]/AVERAGE_COMPUTE_FRAME;
-      }else if(!sigma_normalized && frame_index < SIGMA_COMPUTE_FRAME + AVERAGE_COMPUTE_FRAME){
-	current_value = current_frame[index];
-	difference = current_value - average_frame[index];
-	if(current_value < average_frame[index]){
-	  difference = average_frame[index] - current_value;
-	}
-	//printk("average_computed %d %d %d %02X\n", difference, current_frame[index], average_frame[index], current_frame[index]);
-	if(frame_index == AVERAGE_COMPUTE_FRAME+1)
-	  sigma_frame[index] = difference;
-	else
-	  sigma_frame[index] += difference;
+	retval = skel_send_command(dev, SKEL_CMD_SCAN_WINDOW, window,
+				   sizeof(*window));
+	if (retval)
+		return retval;
 
-	if(sigma_frame[index] > 65000){
-	  printk("sigma is high %d %d %d %d\n", i, j, index, average_frame[index]);
-	}
-	
-      }else if(!sigma_normalized && frame_index == SIGMA_COMPUTE_FRAME + AVERAGE_COMPUTE_FRAME){
-	//printk("1 sigma_computed %d \n", sigma_frame[index]);
-	sigma_frame[index] = sigma_frame[index]/SIGMA_COMPUTE_FRAME;
-	if(sigma_frame[index] < 1)
-	  sigma_frame[index] = 1;
-	//printk("2 sigma_computed %d \n", sigma_frame[index]);
-      }else if(sigma_normalized && average_computed){
-	current_value = current_frame[index];
-	difference = current_value - average_frame[index];
-
-	sigma = sigma_frame[index];
-        score_frame_adjacent[index] = 0;
-
-	if(current_value < average_frame[index]){ 
-	  difference = average_frame[index] - current_value;
-	}
+	spin_lock_irq(&dev->err_lock);
+	dev->params_next.window = *window;
+	dev->params_dirty = true;
+	spin_unlock_irq(&dev->err_lock);
+	return 0;
+}
 
+/* after a reset, program what the sensor forgot */
+static void skel_restore_commands(struct usb_skel *dev)
+{
+	struct skel_scan_window window;
 
-	score_frame[index] = difference/sigma;
+	if (dev->commands_unsupported)
+		return;
+	if (dev->scan_rate)
+		skel_set_scan_rate(dev, dev->scan_rate);
 
-	/* compute top left cell with adjacent cells*/
-	for(k=-2;k<1;k++){
-	  for(l=-2;l<1;l++){
-	    if(l+j>0 && k+i>0){
-	      adj_index = (l+j)+(k+i)*64+64+64*BLOB_LINE_OFFSET;
-	      score = score_frame[adj_index];
-	      score_frame_adjacent[index-(65)] += score;
-	    }
-	  }
-	}
+	spin_lock_irq(&dev->err_lock);
+	window = dev->params_next.window;
+	spin_unlock_irq(&dev->err_lock);
+	if (window.lines != FRAME_ROWS || window.columns != FRAME_COLS)
+		skel_set_scan_window(dev, &window);
+}
 
-	score_frame_adjacent[index] = (score_frame_adjacent[index] + score_last_frame_adjacent[index])/2;
+/*
+ * Tiles holding a cell of @window, with frame line @line_offset shown as
+ * row 0. A window may wrap around the last frame line.
+ */
+static u64 skel_window_tiles(const struct skel_scan_window *window,
+			     unsigned int line_offset)
+{
+	u64 tiles = 0;
+	int i, j;
+
+	for (i = 0; i < FRAME_ROWS; i++) {
+		if ((i + line_offset + FRAME_ROWS - window->line) % FRAME_ROWS >=
+		    window->lines)
+			continue;
+		for (j = window->column;
+		     j < window->column + window->columns; j++)
+			tiles |= BIT_ULL(i / ROI_TILE * ROI_TILES_X +
+					 j / ROI_TILE);
+	}
+	return tiles;
+}
 
+/*
+ * Frame acquisition: READS_IN_FLIGHT urbs stay queued on the bulk in
+ * endpoint, so the sensor is never waiting for the host. Every urb
+ * transfers straight into a slot of the frame ring, up to frames_per_urb
+ * frames back to back; on completion the slot is queued, frame_work is
+ * kicked and the urb is resubmitted on a free slot. frame_work splits
+ * the slot into its frames again. When the worker falls behind and no
+ * slot is free, the oldest unprocessed slot is recycled and counted as
+ * an overrun.
+ * The frame urbs are not anchored on submitted: they are only stopped
+ * by skel_stop_streaming(), so flushing the character device leaves the
+ * input device streaming.
+ * All ring bookkeeping is done under err_lock.
+ */
+static void skel_ring_reset(struct usb_skel *dev)
+{
+	int i;
 
-	score = score_frame_adjacent[index];
+	int slot = 0;
 
-	cell_triggered = false;
-	if(score <= sigma_threshold_factor)
-	  printk("  ");
-	else if(score/10 > 99){
-	  printk("XX");
-	  cell_triggered = true;
-	}else{
-	  printk("%02d",score/10);
-	  cell_triggered = true;
-	}
+	dev->ready_head = 0;
+	dev->ready_count = 0;
+	dev->free_count = 0;
 
-	if(contact_index < MAX_CONTACTS){
-	  if(cell_triggered){
-	    /* is this point part of an other detected contact */
-	    contact_match_index = -1;
-	    for(m=0;m<contact_index;m++){
-	      contact = &touch_contacts[m];
-	      if(j >= contact->x -2 && j < contact->x + contact->w +3 &&
-		 i >= contact->y -2 && i < contact->y + contact->h +3){
-		contact_match_index = m;
-		break;
-	      }
-	    }
-	    
-	    if(contact_match_index>-1){
-	      contact = &touch_contacts[contact_match_index];
-	      if(j - contact->x +1 > contact->w)
-		contact->w = j - contact->x + 1;
-	      if(i - contact->y +1> contact->h)
-		contact->h = i - contact->y + 1;
-	    }else{
-	      contact_index++;
-	      contact = &touch_contacts[contact_index];
-	      contact->x = j;
-	      contact->y = i;
-	      contact->h = 1;
-	      contact->w = 1;
-	      //printk("%d %d %d %d --\n",contact->x, contact->y, contact->w, contact->h );
-	    }
-	    
-	  }else{
-	    
-	  }
+	/*
+	 * the first slots go to the urbs, the others are free; a slot
+	 * frame_work is still scoring is given back by frame_work itself
+	 */
+	for (i = 0; i < READS_IN_FLIGHT; i++, slot++) {
+		if (slot == dev->busy_slot)
+			slot++;
+		dev->urb_slot[i] = slot;
+		dev->frame_urbs[i]->transfer_buffer = dev->ring[slot].data;
+		dev->frame_urbs[i]->transfer_dma = dev->ring[slot].dma;
 	}
-	
-	memcpy(score_last_frame_adjacent, score_frame_adjacent, 4160*2);
-      }     
-    }
-    if(sigma_normalized && average_computed)
-      printk("\n");
-    
-  }
-
-  if(sigma_normalized && average_computed){
-    printk("%d \n", contact_index);
-    for(m=0;m<contact_index;m++){
-      contact = &touch_contacts[m];
-      printk("%02d %02d %02d %02d --\n",contact->x, contact->y, contact->w, contact->h );
-    }
-    //debug_matrix(score_frame, score_frame_adjacent);
-  }
-
-  return retval;
+	for (i = dev->ring_depth - 1; i >= slot; i--)
+		if (i != dev->busy_slot)
+			dev->free_slots[dev->free_count++] = i;
 }
 
-/* core function: poll for new input data */
-static void skel_poll(struct input_polled_dev *polldev)
+/* pick the slot the urb fills next, called with err_lock held */
+static int skel_ring_get_slot(struct usb_skel *dev)
 {
-  struct input_dev *input = polldev->input;
-  struct usb_skel *dev = polldev->private;
-  int result, bulk_read, retval;
-  
-  result = usb_bulk_msg(dev->udev,
-			usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-			dev->bulk_in_buffer,
-			dev->bulk_in_size,
-			&bulk_read,
-			1000);
-
-  if (result < 0) {
-    printk("greentouch error in usb_bulk_read \n" );
-    return;
-  }
-
- 
-  /* Blob is a 64x64 octet matrix representing touch matrix prefixed by 64 
-     unknown octets, normalization and threshold is required */
-  retval = normalize(dev->bulk_in_buffer,
-		     dev->score_frame,
-		     dev->score_frame_adjacent,
-		     dev->score_last_frame_adjacent,
-		     dev->average_frame,
-		     dev->sigma_frame,
-		     dev->frame_index,
-		     dev->sigma_normalized,
-		     dev->average_computed,
-		     dev->touch_contacts);
+	int slot;
 
-  if(!dev->sigma_normalized && dev->frame_index == SIGMA_COMPUTE_FRAME + AVERAGE_COMPUTE_FRAME){
-    dev->sigma_normalized = true;
-    printk("Sgima computed\n");
-  }
+	if (dev->free_count)
+		return dev->free_slots[--dev->free_count];
 
-  if(!dev->average_computed && dev->frame_index == AVERAGE_COMPUTE_FRAME){
-    dev->average_computed = true;
-    printk("Average computed\n");
-  }
-  
-  if(dev->frame_index > CALIBRATE_EVERY){
-    dev->frame_index = 0;
-    dev->average_computed = false;
-    dev->sigma_normalized = false;
-    printk("Calibration relaunched\n");
-  }
+	/* overrun: give up on the oldest frame nobody looked at yet */
+	slot = dev->ready[dev->ready_head];
+	dev->ready_head = (dev->ready_head + 1) % dev->ring_depth;
+	dev->ready_count--;
+	dev->ring_overruns++;
 
-  //skel_report_inputs(dev->touches)
-  
-  input_mt_sync_frame(input);
-  //printk("%s input_mt_sync_frame done\n", __func__);
-  input_sync(input);
-  //printk("%s input_sync done\n", __func__);
-  dev->frame_index++;
+	return slot;
 }
 
+/*
+ * A frame urb failed or could not be submitted while streaming, called
+ * with err_lock held. It is resubmitted by recover_work after a delay
+ * doubling with every failure in a row, so a bad link does not keep the
+ * CPU in a completion and resubmission loop. A stall is cleared there
+ * first. The status is kept out of dev->errors, which belongs to the
+ * write path.
+ */
+static void skel_frame_failed(struct usb_skel *dev, int i, int status)
+{
+	unsigned int delay;
+
+	dev->failed |= BIT(i);
+	if (status == -EPIPE)
+		dev->halted = true;
+	delay = min((1U << min(dev->rx_errors, 10U)) - 1, ERROR_BACKOFF_MAX);
+	dev->rx_errors++;
+	queue_delayed_work(dev->wq, &dev->recover_work,
+			   msecs_to_jiffies(delay));
+}
 
-/* Initialize input device parameters. */
-static void input_setup(struct input_dev *input_dev)
+static void skel_frame_callback(struct urb *urb)
 {
-        __set_bit(EV_KEY, input_dev->evbit);
-	__set_bit(EV_ABS, input_dev->evbit);
+	struct usb_skel *dev;
+	unsigned int frames;
+	bool resubmit;
+	int i, slot, rv;
 
-	input_set_abs_params(input_dev, ABS_MT_POSITION_X,
-			     0, SENSOR_RES_X, 0, 0);
+	dev = urb->context;
+
+	for (i = 0; i < READS_IN_FLIGHT; i++)
+		if (dev->frame_urbs[i] == urb)
+			break;
+
+	spin_lock(&dev->err_lock);
+	/* sync/async unlink faults aren't errors */
+	if (urb->status) {
+		if (!(urb->status == -ENOENT ||
+		    urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN)) {
+			dev_err_ratelimited(&dev->interface->dev,
+				"%s - nonzero read bulk status received: %d\n",
+				__func__, urb->status);
+			u64_stats_update_begin(&dev->stats.rx_syncp);
+			dev->stats.transfer_errors++;
+			u64_stats_update_end(&dev->stats.rx_syncp);
+			if (dev->streaming)
+				skel_frame_failed(dev, i, urb->status);
+		}
+	} else if (urb->actual_length < FRAME_SIZE) {
+		dev->rx_errors = 0;
+		/* the slot is filled again by the resubmission */
+		u64_stats_update_begin(&dev->stats.rx_syncp);
+		dev->stats.short_transfers++;
+		u64_stats_update_end(&dev->stats.rx_syncp);
+	} else {
+		/*
+		 * a short packet may end the transfer after any frame; a
+		 * torn frame at the end is dropped, the others are kept
+		 */
+		dev->rx_errors = 0;
+		frames = urb->actual_length / FRAME_SIZE;
+		u64_stats_update_begin(&dev->stats.rx_syncp);
+		dev->stats.transfers++;
+		dev->stats.frames_received += frames;
+		if (urb->actual_length % FRAME_SIZE)
+			dev->stats.short_transfers++;
+		u64_stats_update_end(&dev->stats.rx_syncp);
+
+		/* hand the filled slot over, the urb moves to another one */
+		dev->ring[dev->urb_slot[i]].timestamp = ktime_get_ns();
+		dev->ring[dev->urb_slot[i]].frames = frames;
+		dev->ready[(dev->ready_head + dev->ready_count) %
+			   dev->ring_depth] = dev->urb_slot[i];
+		dev->ready_count++;
+
+		slot = skel_ring_get_slot(dev);
+		dev->urb_slot[i] = slot;
+		urb->transfer_buffer = dev->ring[slot].data;
+		urb->transfer_dma = dev->ring[slot].dma;
+
+		if (dev->streaming)
+			queue_work(dev->wq, &dev->frame_work);
+	}
+	/* failed urbs are resubmitted by recover_work */
+	resubmit = dev->streaming && !urb->status;
+	/* while a halt is cleared, recover_work resubmits all of them */
+	if (resubmit && dev->recovering) {
+		dev->failed |= BIT(i);
+		resubmit = false;
+	}
+	/* while idle, idle_work asks for the frames one at a time */
+	if (resubmit && dev->idle) {
+		dev->parked |= BIT(i);
+		resubmit = false;
+	}
+	spin_unlock(&dev->err_lock);
+
+	if (!resubmit)
+		return;
+
+	rv = usb_submit_urb(urb, GFP_ATOMIC);
+	if (rv) {
+		if (rv != -EPERM && rv != -ENODEV)
+			dev_err_ratelimited(&dev->interface->dev,
+				"%s - failed resubmitting read urb, error %d\n",
+				__func__, rv);
+		spin_lock(&dev->err_lock);
+		if (dev->streaming)
+			skel_frame_failed(dev, i, rv);
+		spin_unlock(&dev->err_lock);
+	}
+}
+
+/*
+ * resubmit up to @count parked frame urbs, called with err_lock held.
+ * While recover_work clears a halt they stay parked, it resubmits them.
+ */
+static void skel_unpark_urbs(struct usb_skel *dev, unsigned int count)
+{
+	int i, rv;
+
+	for (i = 0; i < READS_IN_FLIGHT && count && !dev->recovering; i++) {
+		if (!(dev->parked & BIT(i)))
+			continue;
+		dev->parked &= ~BIT(i);
+		count--;
+
+		rv = usb_submit_urb(dev->frame_urbs[i], GFP_ATOMIC);
+		if (rv) {
+			dev_err_ratelimited(&dev->interface->dev,
+				"%s - failed submitting read urb, error %d\n",
+				__func__, rv);
+			skel_frame_failed(dev, i, rv);
+		}
+	}
+}
+
+static void skel_stop_streaming(struct usb_skel *dev)
+{
+	int i;
+
+	spin_lock_irq(&dev->err_lock);
+	dev->streaming = false;
+	spin_unlock_irq(&dev->err_lock);
+
+	for (i = 0; i < READS_IN_FLIGHT; i++)
+		usb_kill_urb(dev->frame_urbs[i]);
+	cancel_delayed_work_sync(&dev->idle_work);
+	cancel_delayed_work_sync(&dev->recover_work);
+	cancel_work_sync(&dev->frame_work);
+}
+
+static int skel_start_streaming(struct usb_skel *dev)
+{
+	int i;
+	int rv = 0;
+
+	spin_lock_irq(&dev->err_lock);
+	skel_ring_reset(dev);
+	dev->streaming = true;
+	dev->idle = false;
+	dev->parked = 0;
+	dev->failed = 0;
+	dev->halted = false;
+	dev->recovering = false;
+	dev->rx_errors = 0;
+	spin_unlock_irq(&dev->err_lock);
+	dev->quiet_frames = 0;
+	dev->mode_since = ktime_get_ns();
+
+	for (i = 0; i < READS_IN_FLIGHT; i++) {
+		rv = usb_submit_urb(dev->frame_urbs[i], GFP_KERNEL);
+		if (rv) {
+			dev_err(&dev->interface->dev,
+				"%s - failed submitting read urb, error %d\n",
+				__func__, rv);
+			skel_stop_streaming(dev);
+			break;
+		}
+	}
+
+	return rv;
+}
+
+/* the input core opened/closed the touch device */
+static int skel_input_open(struct input_dev *input)
+{
+	struct usb_skel *dev = input_get_drvdata(input);
+	int rv = -ENODEV;
+
+	mutex_lock(&dev->io_mutex);
+	if (dev->interface)
+		rv = skel_start_streaming(dev);
+	dev->input_opened = !rv;
+	mutex_unlock(&dev->io_mutex);
+
+	return rv;
+}
+
+static void skel_input_close(struct input_dev *input)
+{
+	struct usb_skel *dev = input_get_drvdata(input);
+
+	mutex_lock(&dev->io_mutex);
+	dev->input_opened = false;
+	skel_stop_streaming(dev);
+	mutex_unlock(&dev->io_mutex);
+}
+
+/* consistent copy of the counters, lockless against both writers */
+static void skel_stats_read(struct usb_skel *dev, struct skel_stats *snap)
+{
+	const struct skel_stats *stats = &dev->stats;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin_irq(&stats->rx_syncp);
+		snap->transfers = stats->transfers;
+		snap->frames_received = stats->frames_received;
+		snap->short_transfers = stats->short_transfers;
+		snap->transfer_errors = stats->transfer_errors;
+		snap->frames_injected = stats->frames_injected;
+	} while (u64_stats_fetch_retry_irq(&stats->rx_syncp, start));
+
+	do {
+		start = u64_stats_fetch_begin(&stats->frame_syncp);
+		snap->frames_processed = stats->frames_processed;
+		snap->calibration_frames = stats->calibration_frames;
+		snap->contacts = stats->contacts;
+		snap->contacts_max = stats->contacts_max;
+		snap->score_total = stats->score_total;
+		snap->score_peak = stats->score_peak;
+		snap->process_ns = stats->process_ns;
+		snap->predictions = stats->predictions;
+		snap->predict_error_total = stats->predict_error_total;
+		snap->predict_error_max = stats->predict_error_max;
+		snap->idle_entries = stats->idle_entries;
+		snap->active_ns = stats->active_ns;
+		snap->idle_ns = stats->idle_ns;
+	} while (u64_stats_fetch_retry(&stats->frame_syncp, start));
+}
+static ssize_t skel_show_ring_depth(struct device *dev,
+				    struct device_attribute *attr,
+				    char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", skel->ring_depth);
+}
+
+static ssize_t skel_show_frames_per_urb(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", skel->frames_per_urb);
+}
+
+static ssize_t skel_show_ring_overruns(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+	unsigned long overruns;
+
+	spin_lock_irq(&skel->err_lock);
+	overruns = skel->ring_overruns;
+	spin_unlock_irq(&skel->err_lock);
+
+	return sprintf(buf, "%lu\n", overruns);
+}
+
+static ssize_t skel_show_kernels(struct device *dev,
+				 struct device_attribute *attr,
+				 char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%s\n", READ_ONCE(skel->kernels)->name);
+}
+
+static ssize_t skel_show_force_scalar(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%d\n", skel->force_scalar);
+}
+
+static ssize_t skel_set_force_scalar(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	/* picked up by the next frame */
+	skel->force_scalar = val;
+	WRITE_ONCE(skel->kernels, skel_pick_kernels(val));
+
+	return count;
+}
+
+/* region of interest counters, updated by the frame processing */
+#define SKEL_ROI_ATTR(field)						\
+static ssize_t skel_show_##field(struct device *dev,			\
+				 struct device_attribute *attr,		\
+				 char *buf)				\
+{									\
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));\
+									\
+	return sprintf(buf, "%lu\n", READ_ONCE(skel->roi.field));	\
+}									\
+static DEVICE_ATTR(field, S_IRUGO, skel_show_##field, NULL)
+
+SKEL_ROI_ATTR(idle_frames);
+SKEL_ROI_ATTR(tiles_active);
+SKEL_ROI_ATTR(tiles_processed);
+
+/*
+ * Detection parameters. Values are checked against each other and staged
+ * in params_next, the frame processing switches to them between frames.
+ */
+static int skel_params_check(const struct skel_params *params)
+{
+	/* a calibration must complete before the next one starts */
+	if (params->calibrate_every <= params->calibration_frames)
+		return -EINVAL;
+	return 0;
+}
+
+#define SKEL_PARAM_ATTR(field, lo, hi)					\
+static ssize_t skel_show_##field(struct device *dev,			\
+				 struct device_attribute *attr,		\
+				 char *buf)				\
+{									\
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));\
+	unsigned int val;						\
+									\
+	spin_lock_irq(&skel->err_lock);					\
+	val = skel->params_next.field;					\
+	spin_unlock_irq(&skel->err_lock);				\
+									\
+	return sprintf(buf, "%u\n", val);				\
+}									\
+									\
+static ssize_t skel_set_##field(struct device *dev,			\
+				struct device_attribute *attr,		\
+				const char *buf, size_t count)		\
+{									\
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));\
+	struct skel_params next;					\
+	unsigned int val;						\
+	int retval;							\
+									\
+	if (kstrtouint(buf, 0, &val) || val < (lo) || val > (hi))	\
+		return -EINVAL;						\
+									\
+	spin_lock_irq(&skel->err_lock);					\
+	next = skel->params_next;					\
+	next.field = val;						\
+	retval = skel_params_check(&next);				\
+	if (!retval) {							\
+		skel->params_next = next;				\
+		skel->params_dirty = true;				\
+	}								\
+	spin_unlock_irq(&skel->err_lock);				\
+									\
+	return retval ? retval : count;					\
+}									\
+static DEVICE_ATTR(field, S_IWUSR | S_IRUGO, skel_show_##field,		\
+		   skel_set_##field)
+
+SKEL_PARAM_ATTR(sigma_threshold, 1, U16_MAX);
+SKEL_PARAM_ATTR(calibration_frames, 2, U16_MAX);
+SKEL_PARAM_ATTR(calibrate_every, 3, INT_MAX);
+SKEL_PARAM_ATTR(line_offset, 0, FRAME_ROWS - 1);
+SKEL_PARAM_ATTR(max_contacts, 1, MAX_CONTACTS);
+SKEL_PARAM_ATTR(idle_after, 0, INT_MAX);
+SKEL_PARAM_ATTR(idle_interval, 1, IDLE_INTERVAL_MAX);
+SKEL_PARAM_ATTR(predict_horizon, 0, PREDICT_HORIZON_MAX);
+SKEL_PARAM_ATTR(predict_alpha, 1, 256);
+SKEL_PARAM_ATTR(predict_beta, 0, 256);
+
+/*
+ * Sensor settings, programmed through the command channel. Writes fail
+ * with EOPNOTSUPP when the firmware does not take commands.
+ */
+static ssize_t skel_show_scan_rate(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", READ_ONCE(skel->scan_rate));
+}
+
+static ssize_t skel_set_scan_rate_attr(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int retval;
+
+	if (kstrtouint(buf, 0, &val) || val > SCAN_RATE_MAX)
+		return -EINVAL;
+
+	mutex_lock(&skel->io_mutex);
+	retval = skel_set_scan_rate(skel, val);
+	mutex_unlock(&skel->io_mutex);
+
+	return retval ? retval : count;
+}
+
+static ssize_t skel_show_scan_window(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+	struct skel_scan_window window;
+
+	spin_lock_irq(&skel->err_lock);
+	window = skel->params_next.window;
+	spin_unlock_irq(&skel->err_lock);
+
+	return sprintf(buf, "%u %u %u %u\n", window.line, window.column,
+		       window.lines, window.columns);
+}
+
+/* "line column lines columns", the lines may wrap around the frame */
+static ssize_t skel_set_scan_window_attr(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));
+	struct skel_scan_window window;
+	unsigned int line, column, lines, columns;
+	int retval;
+
+	if (sscanf(buf, "%u %u %u %u", &line, &column, &lines, &columns) != 4 ||
+	    line >= FRAME_ROWS || !lines || lines > FRAME_ROWS ||
+	    column >= FRAME_COLS || !columns || columns > FRAME_COLS - column)
+		return -EINVAL;
+	window.line = line;
+	window.column = column;
+	window.lines = lines;
+	window.columns = columns;
+
+	mutex_lock(&skel->io_mutex);
+	retval = skel_set_scan_window(skel, &window);
+	mutex_unlock(&skel->io_mutex);
+
+	return retval ? retval : count;
+}
+
+static DEVICE_ATTR(scan_rate, S_IWUSR | S_IRUGO, skel_show_scan_rate,
+		   skel_set_scan_rate_attr);
+static DEVICE_ATTR(scan_window, S_IWUSR | S_IRUGO, skel_show_scan_window,
+		   skel_set_scan_window_attr);
+
+/* monitoring counters, in the stats directory */
+#define SKEL_STATS_ATTR(field)						\
+static ssize_t skel_show_stats_##field(struct device *dev,		\
+				       struct device_attribute *attr,	\
+				       char *buf)			\
+{									\
+	struct usb_skel *skel = usb_get_intfdata(to_usb_interface(dev));\
+	struct skel_stats snap;						\
+									\
+	skel_stats_read(skel, &snap);					\
+	return sprintf(buf, "%llu\n", snap.field);			\
+}									\
+static struct device_attribute dev_attr_stats_##field =			\
+	__ATTR(field, S_IRUGO, skel_show_stats_##field, NULL)
+
+SKEL_STATS_ATTR(transfers);
+SKEL_STATS_ATTR(frames_received);
+SKEL_STATS_ATTR(short_transfers);
+SKEL_STATS_ATTR(transfer_errors);
+SKEL_STATS_ATTR(frames_injected);
+SKEL_STATS_ATTR(frames_processed);
+SKEL_STATS_ATTR(calibration_frames);
+SKEL_STATS_ATTR(contacts);
+SKEL_STATS_ATTR(contacts_max);
+SKEL_STATS_ATTR(score_total);
+SKEL_STATS_ATTR(score_peak);
+SKEL_STATS_ATTR(process_ns);
+SKEL_STATS_ATTR(idle_entries);
+SKEL_STATS_ATTR(active_ns);
+SKEL_STATS_ATTR(idle_ns);
+SKEL_STATS_ATTR(predictions);
+SKEL_STATS_ATTR(predict_error_total);
+SKEL_STATS_ATTR(predict_error_max);
+
+static DEVICE_ATTR(ring_depth, S_IRUGO, skel_show_ring_depth, NULL);
+static DEVICE_ATTR(frames_per_urb, S_IRUGO, skel_show_frames_per_urb, NULL);
+static DEVICE_ATTR(ring_overruns, S_IRUGO, skel_show_ring_overruns, NULL);
+static DEVICE_ATTR(kernels, S_IRUGO, skel_show_kernels, NULL);
+static DEVICE_ATTR(force_scalar, S_IWUSR | S_IRUGO, skel_show_force_scalar,
+		   skel_set_force_scalar);
+
+/* snapshot of the running calibration, -ENODATA until there is one */
+static int skel_calibration_save(struct usb_skel *dev,
+				 struct skel_calibration *cal)
+{
+	int k;
+
+	if (!READ_ONCE(dev->calibrated))
+		return -ENODATA;
+
+	cal->magic = cpu_to_le32(SKEL_CALIBRATION_MAGIC);
+	cal->version = cpu_to_le16(SKEL_CALIBRATION_VERSION);
+	cal->cells = cpu_to_le16(FRAME_CELLS);
+	/* taken while frames are processed, cells may be a frame apart */
+	for (k = 0; k < FRAME_CELLS; k++) {
+		cal->average_q8[k] = cpu_to_le16(READ_ONCE(dev->planes->average_q8[k]));
+		cal->sigma_q8[k] = cpu_to_le16(READ_ONCE(dev->planes->sigma_q8[k]));
+	}
+
+	return 0;
+}
+
+static int skel_calibration_check(const struct skel_calibration *cal,
+				  size_t size)
+{
+	if (size != sizeof(*cal) ||
+	    le32_to_cpu(cal->magic) != SKEL_CALIBRATION_MAGIC ||
+	    le16_to_cpu(cal->version) != SKEL_CALIBRATION_VERSION ||
+	    le16_to_cpu(cal->cells) != FRAME_CELLS)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* hand a checked snapshot over to the frame processing, which owns it */
+static void skel_calibration_queue(struct usb_skel *dev,
+				   struct skel_calibration *cal)
+{
+	struct skel_calibration *old;
+
+	spin_lock_irq(&dev->err_lock);
+	old = dev->calibration_pending;
+	dev->calibration_pending = cal;
+	spin_unlock_irq(&dev->err_lock);
+
+	kfree(old);
+}
+
+/*
+ * The calibration attribute is larger than a page, sysfs passes it in
+ * chunks. A read from offset 0 takes a new snapshot, a write is staged
+ * until its last byte arrives and is then restored by the next frame.
+ */
+static ssize_t skel_read_calibration(struct file *file, struct kobject *kobj,
+				     struct bin_attribute *attr, char *buf,
+				     loff_t off, size_t count)
+{
+	struct usb_skel *dev =
+		usb_get_intfdata(to_usb_interface(kobj_to_dev(kobj)));
+	bool fresh = false;
+	ssize_t retval;
+
+	mutex_lock(&dev->calibration_mutex);
+	if (!dev->calibration_snapshot) {
+		dev->calibration_snapshot =
+			kmalloc(sizeof(*dev->calibration_snapshot), GFP_KERNEL);
+		if (!dev->calibration_snapshot) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+		fresh = true;
+	}
+	if (!off || fresh) {
+		retval = skel_calibration_save(dev, dev->calibration_snapshot);
+		if (retval)
+			goto exit;
+	}
+
+	memcpy(buf, (char *)dev->calibration_snapshot + off, count);
+	retval = count;
+exit:
+	mutex_unlock(&dev->calibration_mutex);
+	return retval;
+}
+
+static ssize_t skel_write_calibration(struct file *file, struct kobject *kobj,
+				      struct bin_attribute *attr, char *buf,
+				      loff_t off, size_t count)
+{
+	struct usb_skel *dev =
+		usb_get_intfdata(to_usb_interface(kobj_to_dev(kobj)));
+	ssize_t retval;
+
+	mutex_lock(&dev->calibration_mutex);
+	if (!off && !dev->calibration_io) {
+		dev->calibration_io =
+			kmalloc(sizeof(*dev->calibration_io), GFP_KERNEL);
+		if (!dev->calibration_io) {
+			retval = -ENOMEM;
+			goto exit;
+		}
+	}
+	/* only whole snapshots, written from the start */
+	if (!dev->calibration_io) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	memcpy((char *)dev->calibration_io + off, buf, count);
+	if (off + count == sizeof(*dev->calibration_io)) {
+		retval = skel_calibration_check(dev->calibration_io,
+						sizeof(*dev->calibration_io));
+		if (retval)
+			goto exit;
+		skel_calibration_queue(dev, dev->calibration_io);
+		dev->calibration_io = NULL;
+	}
+	retval = count;
+exit:
+	mutex_unlock(&dev->calibration_mutex);
+	return retval;
+}
+
+/* saved calibration of a replugged foil, greentouch/<serial>.cal */
+static void skel_calibration_loaded(const struct firmware *fw, void *context)
+{
+	struct usb_skel *dev = context;
+	struct skel_calibration *cal;
+
+	if (!fw)
+		goto exit;
+
+	if (skel_calibration_check((const void *)fw->data, fw->size)) {
+		dev_warn(&dev->udev->dev, "Ignoring malformed calibration file\n");
+	} else {
+		cal = kmemdup(fw->data, fw->size, GFP_KERNEL);
+		if (cal)
+			skel_calibration_queue(dev, cal);
+	}
+	release_firmware(fw);
+exit:
+	kref_put(&dev->kref, skel_delete);
+}
+
+static BIN_ATTR(calibration, S_IWUSR | S_IRUSR, skel_read_calibration,
+		skel_write_calibration, sizeof(struct skel_calibration));
+
+static struct bin_attribute *skel_bin_attrs[] = {
+	&bin_attr_calibration,
+	NULL
+};
+
+static struct attribute *skel_attrs[] = {
+	&dev_attr_ring_depth.attr,
+	&dev_attr_frames_per_urb.attr,
+	&dev_attr_ring_overruns.attr,
+	&dev_attr_kernels.attr,
+	&dev_attr_force_scalar.attr,
+	&dev_attr_idle_frames.attr,
+	&dev_attr_tiles_active.attr,
+	&dev_attr_tiles_processed.attr,
+	&dev_attr_sigma_threshold.attr,
+	&dev_attr_calibration_frames.attr,
+	&dev_attr_calibrate_every.attr,
+	&dev_attr_line_offset.attr,
+	&dev_attr_max_contacts.attr,
+	&dev_attr_idle_after.attr,
+	&dev_attr_idle_interval.attr,
+	&dev_attr_predict_horizon.attr,
+	&dev_attr_predict_alpha.attr,
+	&dev_attr_predict_beta.attr,
+	&dev_attr_scan_rate.attr,
+	&dev_attr_scan_window.attr,
+	NULL
+};
+
+static struct attribute_group skel_attribute_group = {
+	.attrs = skel_attrs,
+	.bin_attrs = skel_bin_attrs
+};
+
+static struct attribute *skel_stats_attrs[] = {
+	&dev_attr_stats_transfers.attr,
+	&dev_attr_stats_frames_received.attr,
+	&dev_attr_stats_short_transfers.attr,
+	&dev_attr_stats_transfer_errors.attr,
+	&dev_attr_stats_frames_injected.attr,
+	&dev_attr_stats_frames_processed.attr,
+	&dev_attr_stats_calibration_frames.attr,
+	&dev_attr_stats_contacts.attr,
+	&dev_attr_stats_contacts_max.attr,
+	&dev_attr_stats_score_total.attr,
+	&dev_attr_stats_score_peak.attr,
+	&dev_attr_stats_process_ns.attr,
+	&dev_attr_stats_idle_entries.attr,
+	&dev_attr_stats_active_ns.attr,
+	&dev_attr_stats_idle_ns.attr,
+	&dev_attr_stats_predictions.attr,
+	&dev_attr_stats_predict_error_total.attr,
+	&dev_attr_stats_predict_error_max.attr,
+	NULL
+};
+
+static struct attribute_group skel_stats_group = {
+	.name = "stats",
+	.attrs = skel_stats_attrs
+};
+
+/* debugfs: ASCII heatmap of the last smoothed frame, drawn on read */
+static struct dentry *skel_debugfs_root;
+
+static int skel_heatmap_show(struct seq_file *m, void *v)
+{
+	struct usb_skel *dev = m->private;
+	/* last written plane; a frame completing meanwhile may tear the map */
+	unsigned short *score_frame_adjacent =
+		READ_ONCE(dev->score_last_frame_adjacent);
+	int threshold = READ_ONCE(dev->params.sigma_threshold);
+	int i, j, score;
+
+	seq_puts(m, "################################################################\n");
+	for (i = 0; i < FRAME_ROWS; i++) {
+		seq_printf(m, "%2d", i);
+		for (j = 0; j < FRAME_COLS; j++) {
+			score = score_frame_adjacent[i * FRAME_COLS + j];
+			if (score <= threshold)
+				seq_puts(m, "  ");
+			else if (score / 10 > 99)
+				seq_puts(m, "XX");
+			else
+				seq_printf(m, "%02d", score / 10);
+		}
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int skel_heatmap_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, skel_heatmap_show, inode->i_private);
+}
+
+static const struct file_operations skel_heatmap_fops = {
+	.owner =	THIS_MODULE,
+	.open =		skel_heatmap_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* debugfs: how many frames each tile went through the pipeline */
+static int skel_tiles_show(struct seq_file *m, void *v)
+{
+	struct usb_skel *dev = m->private;
+	int ty, tx;
+
+	for (ty = 0; ty < ROI_TILES_Y; ty++) {
+		for (tx = 0; tx < ROI_TILES_X; tx++)
+			seq_printf(m, " %10u",
+				   READ_ONCE(dev->roi.tile_hits[ty * ROI_TILES_X + tx]));
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int skel_tiles_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, skel_tiles_show, inode->i_private);
+}
+
+static const struct file_operations skel_tiles_fops = {
+	.owner =	THIS_MODULE,
+	.open =		skel_tiles_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* debugfs: latency histograms of the pipeline stages */
+static int skel_latency_show(struct seq_file *m, void *v)
+{
+	struct usb_skel *dev = m->private;
+	struct skel_latency *latency;
+	int stage, b;
+
+	seq_printf(m, "%-7s %10s %8s %8s", "stage", "frames", "mean_us", "max_us");
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+		seq_printf(m, " %7s%lu", "<", 1UL << b);
+	seq_printf(m, " %7s%lu\n", ">=", 1UL << (LATENCY_BUCKETS - 2));
+
+	for (stage = 0; stage < SKEL_STAGES; stage++) {
+		latency = &dev->latency[stage];
+		seq_printf(m, "%-7s %10lu %8llu %8llu", skel_stage_names[stage],
+			   latency->count,
+			   latency->count ?
+			   div_u64(latency->total_ns, latency->count) / NSEC_PER_USEC : 0,
+			   div_u64(latency->max_ns, NSEC_PER_USEC));
+		for (b = 0; b < LATENCY_BUCKETS; b++)
+			seq_printf(m, " %8u", latency->buckets[b]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int skel_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, skel_latency_show, inode->i_private);
+}
+
+static const struct file_operations skel_latency_fops = {
+	.owner =	THIS_MODULE,
+	.open =		skel_latency_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* debugfs: the monitoring counters with their means */
+static int skel_stats_show(struct seq_file *m, void *v)
+{
+	struct usb_skel *dev = m->private;
+	struct skel_stats snap;
+	u64 scored, mean;
+
+	skel_stats_read(dev, &snap);
+	scored = snap.frames_processed - snap.calibration_frames;
+
+	seq_printf(m, "transfers %llu\n", snap.transfers);
+	seq_printf(m, "frames_received %llu\n", snap.frames_received);
+	seq_printf(m, "short_transfers %llu\n", snap.short_transfers);
+	seq_printf(m, "transfer_errors %llu\n", snap.transfer_errors);
+	seq_printf(m, "frames_injected %llu\n", snap.frames_injected);
+	seq_printf(m, "frames_processed %llu\n", snap.frames_processed);
+	seq_printf(m, "calibration_frames %llu\n", snap.calibration_frames);
+	seq_printf(m, "contacts %llu\n", snap.contacts);
+	seq_printf(m, "contacts_max %llu\n", snap.contacts_max);
+	seq_printf(m, "score_peak %llu\n", snap.score_peak);
+
+	/* means in hundredths */
+	mean = scored ? div64_u64(snap.contacts * 100, scored) : 0;
+	seq_printf(m, "contacts_mean %llu.%02llu\n", div_u64(mean, 100),
+		   mean - div_u64(mean, 100) * 100);
+	mean = scored ? div64_u64(snap.score_total * 100, scored * FRAME_CELLS) : 0;
+	seq_printf(m, "score_mean %llu.%02llu\n", div_u64(mean, 100),
+		   mean - div_u64(mean, 100) * 100);
+	seq_printf(m, "process_ns_mean %llu\n", snap.frames_processed ?
+		   div64_u64(snap.process_ns, snap.frames_processed) : 0);
+	seq_printf(m, "idle_entries %llu\n", snap.idle_entries);
+	seq_printf(m, "active_ms %llu\n", div_u64(snap.active_ns, NSEC_PER_MSEC));
+	seq_printf(m, "idle_ms %llu\n", div_u64(snap.idle_ns, NSEC_PER_MSEC));
+	seq_printf(m, "idle %d\n", READ_ONCE(dev->idle));
+	seq_printf(m, "predictions %llu\n", snap.predictions);
+	seq_printf(m, "predict_error_mean %llu\n", snap.predictions ?
+		   div64_u64(snap.predict_error_total, snap.predictions) : 0);
+	seq_printf(m, "predict_error_max %llu\n", snap.predict_error_max);
+
+	return 0;
+}
+
+static int skel_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, skel_stats_show, inode->i_private);
+}
+
+static const struct file_operations skel_stats_fops = {
+	.owner =	THIS_MODULE,
+	.open =		skel_stats_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/*
+ * Test hook for load and latency measurements without a sensor signal:
+ * a write of whole frames, at most frames_per_urb, goes through the ring
+ * as if one transfer had just brought them in. The frames are stamped
+ * with the time of the write and scored and reported like real ones.
+ * The input device must be open, real transfers keep streaming.
+ */
+static ssize_t skel_inject_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct usb_skel *dev = file->private_data;
+	ssize_t retval = count;
+	int slot;
+
+	if (!count || count % FRAME_SIZE || count > dev->bulk_in_size)
+		return -EINVAL;
+
+	/* the ring is not reset under us while we fill a slot */
+	mutex_lock(&dev->io_mutex);
+	if (!dev->interface) {		/* disconnect() was called */
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	spin_lock_irq(&dev->err_lock);
+	if (!dev->streaming) {
+		spin_unlock_irq(&dev->err_lock);
+		retval = -EAGAIN;
+		goto exit;
+	}
+	slot = skel_ring_get_slot(dev);
+	spin_unlock_irq(&dev->err_lock);
+
+	if (copy_from_user(dev->ring[slot].data, buf, count)) {
+		spin_lock_irq(&dev->err_lock);
+		dev->free_slots[dev->free_count++] = slot;
+		spin_unlock_irq(&dev->err_lock);
+		retval = -EFAULT;
+		goto exit;
+	}
+
+	spin_lock_irq(&dev->err_lock);
+	dev->ring[slot].timestamp = ktime_get_ns();
+	dev->ring[slot].frames = count / FRAME_SIZE;
+	dev->ready[(dev->ready_head + dev->ready_count) %
+		   dev->ring_depth] = slot;
+	dev->ready_count++;
+	u64_stats_update_begin(&dev->stats.rx_syncp);
+	dev->stats.frames_injected += count / FRAME_SIZE;
+	u64_stats_update_end(&dev->stats.rx_syncp);
+	spin_unlock_irq(&dev->err_lock);
+	queue_work(dev->wq, &dev->frame_work);
+
+exit:
+	mutex_unlock(&dev->io_mutex);
+	return retval;
+}
+
+static const struct file_operations skel_inject_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.write =	skel_inject_write,
+	.llseek =	no_llseek,
+};
+
+#ifdef SKEL_HAVE_SIMD
+#ifdef CONFIG_X86
+static const struct skel_kernels skel_sse2_kernels = {
+	.name = "sse2",
+	.simd = true,
+	.accumulate = skel_accumulate_sse2,
+	.score = skel_score_sse2,
+};
+
+static const struct skel_kernels skel_avx2_kernels = {
+	.name = "avx2",
+	.simd = true,
+	.accumulate = skel_accumulate_avx2,
+	.score = skel_score_avx2,
+};
+#else
+static const struct skel_kernels skel_neon_kernels = {
+	.name = "neon",
+	.simd = true,
+	.accumulate = skel_accumulate_neon,
+	.score = skel_score_neon,
+};
+#endif
+#endif
+
+/* best kernels for this CPU */
+static const struct skel_kernels *skel_pick_kernels(bool force_scalar)
+{
+	if (force_scalar)
+		return &skel_scalar_kernels;
+#ifdef SKEL_HAVE_SIMD
+#ifdef CONFIG_X86
+	if (boot_cpu_has(X86_FEATURE_AVX2))
+		return &skel_avx2_kernels;
+	return &skel_sse2_kernels;
+#else
+	return &skel_neon_kernels;
+#endif
+#else
+	return &skel_scalar_kernels;
+#endif
+}
+
+/*
+ * Enter the FPU/NEON context the kernels need. When the vector unit may
+ * not be used from here, the scalar kernels are returned instead.
+ */
+const struct skel_kernels *skel_kernels_begin(const struct skel_kernels *k)
+{
+#ifdef SKEL_HAVE_SIMD
+	if (k->simd) {
+		if (!may_use_simd())
+			return &skel_scalar_kernels;
+#ifdef CONFIG_X86
+		kernel_fpu_begin();
+#else
+		kernel_neon_begin();
+#endif
+	}
+#endif
+	return k;
+}
+
+void skel_kernels_end(const struct skel_kernels *k)
+{
+#ifdef SKEL_HAVE_SIMD
+	if (k->simd) {
+#ifdef CONFIG_X86
+		kernel_fpu_end();
+#else
+		kernel_neon_end();
+#endif
+	}
+#endif
+}
+
+/*
+ * How far off the last prediction of @track was: the contact position at
+ * its target time, interpolated between the measurement before it and
+ * @pos at @timestamp, against the predicted one.
+ */
+static void skel_predict_check(struct usb_skel *dev, struct skel_track *track,
+			       const struct input_mt_pos *pos, u64 timestamp)
+{
+	s64 span = timestamp - track->timestamp;
+	s64 part = track->target_ns - track->timestamp;
+	int x = pos->x, y = pos->y;
+	u64 error;
+
+	if (span > 0) {
+		x = track->seen_x + div64_s64((s64)(pos->x - track->seen_x) *
+					      part, span);
+		y = track->seen_y + div64_s64((s64)(pos->y - track->seen_y) *
+					      part, span);
+	}
+	x -= track->predicted_x;
+	y -= track->predicted_y;
+	error = int_sqrt((unsigned long)x * x + (unsigned long)y * y);
+	track->pending = false;
+
+	u64_stats_update_begin(&dev->stats.frame_syncp);
+	dev->stats.predictions++;
+	dev->stats.predict_error_total += error;
+	dev->stats.predict_error_max = max(dev->stats.predict_error_max, error);
+	u64_stats_update_end(&dev->stats.frame_syncp);
+}
+
+static s32 skel_predict_axis(s32 *x, s32 *v, int seen, u32 dt_us,
+			     const struct skel_params *params, int res)
+{
+	s32 residual;
+
+	/* alpha-beta filter: move to the prediction, correct by the residual */
+	*x += div_s64((s64)*v * dt_us, USEC_PER_MSEC);
+	residual = (seen << 8) - *x;
+	*x += residual * (s32)params->predict_alpha / 256;
+	if (dt_us)
+		*v = clamp_t(s64, *v + div_s64((s64)residual *
+				params->predict_beta * USEC_PER_MSEC,
+				256 * dt_us), -(res << 8), res << 8);
+
+	return clamp((*x + *v * (s32)params->predict_horizon) >> 8, 0, res - 1);
+}
+
+/*
+ * Motion prediction: each slot runs an alpha-beta filter over the
+ * positions of its contact, and @pos is moved to where the contact will
+ * be predict_horizon ms after the frame was sampled. It starts over when
+ * the slot gets a new tracking id or misses a frame. Frames of one
+ * transfer share a timestamp, they only correct the position. One
+ * prediction per slot at a time is checked against the contact, see
+ * skel_predict_check().
+ */
+static void skel_predict(struct usb_skel *dev, struct skel_track *track,
+			 int tracking_id, struct input_mt_pos *pos,
+			 u64 timestamp)
+{
+	const struct skel_params *params = &dev->params;
+	u64 dt = timestamp - track->timestamp;
+	u32 dt_us;
+
+	if (track->seq != dev->report_seq - 1 || dt > PREDICT_GAP_NS ||
+	    track->tracking_id != tracking_id) {
+		/* a new contact starts at rest */
+		track->tracking_id = tracking_id;
+		track->x = pos->x << 8;
+		track->y = pos->y << 8;
+		track->vx = 0;
+		track->vy = 0;
+		track->pending = false;
+		dt = 0;
+	} else if (track->pending && timestamp >= track->target_ns) {
+		skel_predict_check(dev, track, pos, timestamp);
+	}
+	dt_us = div_u64(dt, NSEC_PER_USEC);
+	track->seq = dev->report_seq;
+	track->timestamp = timestamp;
+	track->seen_x = pos->x;
+	track->seen_y = pos->y;
+
+	pos->x = skel_predict_axis(&track->x, &track->vx, pos->x, dt_us,
+				   params, SENSOR_RES_X);
+	pos->y = skel_predict_axis(&track->y, &track->vy, pos->y, dt_us,
+				   params, SENSOR_RES_Y);
+
+	if (!track->pending) {
+		track->pending = true;
+		track->target_ns = timestamp +
+			params->predict_horizon * NSEC_PER_MSEC;
+		track->predicted_x = pos->x;
+		track->predicted_y = pos->y;
+	}
+}
+
+/*
+ * Reporting stage: the contacts of this frame are matched against the
+ * slots of the previous one by input_mt_assign_slots(), so a finger keeps
+ * its tracking id while it moves, against the positions reported last
+ * frame. Slots left unused are released by input_mt_sync_frame().
+ */
+static void skel_report_contacts(struct usb_skel *dev, struct input_dev *input,
+				 int count, u64 timestamp)
+{
+	struct touch_contact *contact;
+	int i, slot, w, h, retval;
+
+	for (i = 0; i < count; i++) {
+		dev->contact_pos[i].x = dev->touch_contacts[i].pos_x;
+		dev->contact_pos[i].y = dev->touch_contacts[i].pos_y;
+	}
+
+	retval = input_mt_assign_slots(input, dev->contact_slots,
+				       dev->contact_pos, count, TRACK_DMAX);
+	if (retval)
+		count = 0;
+
+	dev->report_seq++;
+	for (i = 0; i < count; i++) {
+		contact = &dev->touch_contacts[i];
+		slot = dev->contact_slots[i];
+		w = contact->w * SENSOR_RES_X / FRAME_COLS;
+		h = contact->h * SENSOR_RES_Y / FRAME_ROWS;
+
+		input_mt_slot(input, slot);
+		input_mt_report_slot_state(input, MT_TOOL_FINGER, true);
+		/* a contact new in the slot got a tracking id just now */
+		if (dev->params.predict_horizon)
+			skel_predict(dev, &dev->tracks[slot],
+				     input_mt_get_value(&input->mt->slots[slot],
+							ABS_MT_TRACKING_ID),
+				     &dev->contact_pos[i], timestamp);
+		input_report_abs(input, ABS_MT_POSITION_X, dev->contact_pos[i].x);
+		input_report_abs(input, ABS_MT_POSITION_Y, dev->contact_pos[i].y);
+		input_report_abs(input, ABS_MT_TOUCH_MAJOR, max(w, h));
+		input_report_abs(input, ABS_MT_TOUCH_MINOR, min(w, h));
+		input_report_abs(input, ABS_MT_ORIENTATION, w > h);
+	}
+
+	input_mt_sync_frame(input);
+}
+
+static void skel_latency_add(struct skel_latency *latency, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	latency->count++;
+	latency->total_ns += ns;
+	latency->max_ns = max(latency->max_ns, ns);
+	latency->buckets[min_t(unsigned int, fls64(us), LATENCY_BUCKETS - 1)]++;
+}
+
+/* what the pipeline runs with for this frame */
+static void skel_get_options(struct usb_skel *dev,
+			     struct skel_pipeline_options *options)
+{
+	options->roi = READ_ONCE(roi_enable);
+	options->peak_fit = READ_ONCE(peak_fit);
+	options->continuous = READ_ONCE(continuous_calibration);
+	options->threshold = dev->params.sigma_threshold;
+	options->calibration_frames = dev->params.calibration_frames;
+	options->line_offset = dev->params.line_offset;
+	options->max_contacts = dev->params.max_contacts;
+	options->window = dev->window_tiles;
+}
+
+/*
+ * Switch to parameters written since the last frame. A calibration in
+ * progress restarts when its frame count changes, the ROI gates follow
+ * the threshold and the line offset.
+ */
+static void skel_params_apply(struct usb_skel *dev,
+			      const struct skel_params *next)
+{
+	struct skel_pipeline_options options;
+	bool regate;
+	int ty;
+
+	regate = next->sigma_threshold != dev->params.sigma_threshold ||
+		next->line_offset != dev->params.line_offset;
+	if (!dev->calibrated &&
+	    next->calibration_frames != dev->params.calibration_frames) {
+		dev->frame_index = 0;
+		trace_greentouch_calibration(dev->frame_index,
+					     "calibration restarted");
+	}
+	dev->params = *next;
+	dev->window_tiles = skel_window_tiles(&next->window, next->line_offset);
+
+	if (dev->calibrated && regate) {
+		skel_get_options(dev, &options);
+		for (ty = 0; ty < ROI_TILES_Y; ty++)
+			skel_roi_update_gates(dev->planes->sigma, &dev->roi, ty,
+					      &options);
+	}
+}
+
+/* take a saved calibration as if it had just been computed */
+static void skel_calibration_restore(struct usb_skel *dev,
+				     const struct skel_calibration *cal,
+				     const struct skel_pipeline_options *options)
+{
+	struct skel_planes *planes = dev->planes;
+	int k;
+
+	for (k = 0; k < FRAME_CELLS; k++) {
+		planes->average_q8[k] = le16_to_cpu(cal->average_q8[k]);
+		planes->sigma_q8[k] = le16_to_cpu(cal->sigma_q8[k]);
+		planes->average[k] = min((planes->average_q8[k] + 128) >> 8, 255);
+		planes->sigma[k] = max((planes->sigma_q8[k] + 128) >> 8, 1);
+	}
+	skel_update_recip(planes->sigma, planes->recip);
+	for (k = 0; k < ROI_TILES_Y; k++)
+		skel_roi_update_gates(planes->sigma, &dev->roi, k, options);
+
+	dev->calibrated = true;
+	dev->frame_index = options->calibration_frames;
+}
+
+/*
+ * Idle mode: after idle_after frames without a triggered tile, only one
+ * frame is read every idle_interval ms. The first touched frame brings
+ * the full rate back. Returns true when the
+ * device just went idle.
+ */
+static bool skel_idle_update(struct usb_skel *dev, bool touched)
+{
+	bool idle = dev->idle, entered;
+
+	if (touched || !dev->calibrated)
+		dev->quiet_frames = 0;
+	else if (dev->quiet_frames < INT_MAX)
+		dev->quiet_frames++;
+
+	if (idle)
+		idle = !touched;
+	else
+		idle = dev->params.idle_after &&
+			dev->quiet_frames >= dev->params.idle_after;
+	if (idle == dev->idle)
+		return false;
+	entered = idle;
+
+	spin_lock_irq(&dev->err_lock);
+	dev->idle = idle;
+	if (!idle && dev->streaming)
+		skel_unpark_urbs(dev, READS_IN_FLIGHT);
+	spin_unlock_irq(&dev->err_lock);
+
+	trace_greentouch_idle(dev->frame_index, idle);
+
+	return entered;
+}
+
+/* score one frame of the ring and report it */
+static void skel_process_frame(struct usb_skel *dev, struct input_dev *input,
+			       unsigned char *frame, u64 timestamp)
+{
+  struct skel_pipeline_options options;
+  struct skel_score_summary summary;
+  struct greentouch_capture_header *capture;
+  struct skel_calibration *calibration;
+  struct skel_params params;
+  struct touch_contact *contact;
+  u64 started_at, scored_at = 0, labelled_at, synced_at;
+  bool scored, retune, was_idle, went_idle;
+  int retval, m;
+
+  spin_lock_irq(&dev->err_lock);
+  calibration = dev->calibration_pending;
+  dev->calibration_pending = NULL;
+  retune = dev->params_dirty;
+  if(retune){
+    params = dev->params_next;
+    dev->params_dirty = false;
+  }
+  spin_unlock_irq(&dev->err_lock);
+  if(retune)
+    skel_params_apply(dev, &params);
+
+  skel_get_options(dev, &options);
+  if(calibration){
+    skel_calibration_restore(dev, calibration, &options);
+    kfree(calibration);
+    trace_greentouch_calibration(dev->frame_index, "calibration restored");
+  }
+
+  started_at = ktime_get_ns();
+  scored = dev->calibrated;
+
+  /* Blob is a 64x64 octet matrix representing touch matrix prefixed by 64 
+     unknown octets, normalization and threshold is required */
+  retval = normalize(frame,
+		     dev->planes->score,
+		     dev->score_frame_adjacent,
+		     dev->score_last_frame_adjacent,
+		     dev->planes->average,
+		     dev->planes->sigma,
+		     dev->planes->recip,
+		     dev->planes->calib_sum,
+		     dev->planes->calib_sumsq,
+		     dev->planes->box_scratch,
+		     READ_ONCE(dev->kernels),
+		     dev->frame_index,
+		     dev->calibrated,
+		     &options,
+		     dev->planes->average_q8,
+		     dev->planes->sigma_q8,
+		     &dev->roi,
+		     dev->labels,
+		     dev->touch_contacts,
+		     &summary,
+		     &scored_at);
+  labelled_at = ktime_get_ns();
+  if(!scored_at)
+    scored_at = labelled_at;
+
+  for(m=0;m<retval;m++){
+    contact = &dev->touch_contacts[m];
+    trace_greentouch_contact(m, contact->x, contact->y, contact->w, contact->h);
+  }
+  trace_greentouch_frame(dev->frame_index,
+			 dev->calibrated, retval);
+
+  /* this frame's smoothed scores are the next frame's history */
+  if(dev->calibrated){
+    swap(dev->score_frame_adjacent, dev->score_last_frame_adjacent);
+    swap(dev->roi.adjacent_tiles, dev->roi.last_tiles);
+  }
+
+  /* pairs with the release in skel_capture_alloc() */
+  capture = smp_load_acquire(&dev->capture);
+  if(capture && READ_ONCE(dev->capture_users))
+    skel_capture_frame(dev, capture, frame, timestamp);
+
+  if(!dev->calibrated && dev->frame_index == options.calibration_frames){
+    dev->calibrated = true;
+    trace_greentouch_calibration(dev->frame_index, "calibrated");
+  }
+  
+  if(dev->frame_index > dev->params.calibrate_every && dev->calibrated &&
+     options.continuous){
+    /* the baseline is tracked while scoring, keep the index in the scored range */
+    dev->frame_index = options.calibration_frames;
+  }else if(dev->frame_index > dev->params.calibrate_every){
+    dev->frame_index = 0;
+    dev->calibrated = false;
+    trace_greentouch_calibration(dev->frame_index, "calibration relaunched");
+  }
+
+  /* events carry the sampling time of the frame, not the time of the sync */
+  input_set_timestamp(input, ns_to_ktime(timestamp));
+  /* nothing is touching while calibrating: every slot is released */
+  skel_report_contacts(dev, input, retval, timestamp);
+  input_sync(input);
+  synced_at = ktime_get_ns();
+
+  skel_latency_add(&dev->latency[SKEL_STAGE_QUEUE], started_at - timestamp);
+  skel_latency_add(&dev->latency[SKEL_STAGE_SCORE], scored_at - started_at);
+  skel_latency_add(&dev->latency[SKEL_STAGE_LABEL], labelled_at - scored_at);
+  skel_latency_add(&dev->latency[SKEL_STAGE_REPORT], synced_at - labelled_at);
+  skel_latency_add(&dev->latency[SKEL_STAGE_TOTAL], synced_at - timestamp);
+  trace_greentouch_latency(dev->frame_index, started_at - timestamp,
+			   scored_at - started_at, labelled_at - scored_at,
+			   synced_at - labelled_at);
+
+  was_idle = dev->idle;
+  went_idle = skel_idle_update(dev, dev->roi.triggered || retval);
+
+  u64_stats_update_begin(&dev->stats.frame_syncp);
+  dev->stats.frames_processed++;
+  if(was_idle)
+    dev->stats.idle_ns += synced_at - dev->mode_since;
+  else
+    dev->stats.active_ns += synced_at - dev->mode_since;
+  if(went_idle)
+    dev->stats.idle_entries++;
+  if(scored){
+    dev->stats.contacts += retval;
+    dev->stats.contacts_max = max_t(u64, dev->stats.contacts_max, retval);
+    dev->stats.score_total += summary.sum;
+    dev->stats.score_peak = max_t(u64, dev->stats.score_peak, summary.peak);
+  }else{
+    dev->stats.calibration_frames++;
+  }
+  dev->stats.process_ns += synced_at - started_at;
+  u64_stats_update_end(&dev->stats.frame_syncp);
+  dev->mode_since = synced_at;
+  dev->frame_index++;
+}
+
+
+/* process the frames the acquisition queued, in order */
+static void skel_frame_work(struct work_struct *work)
+{
+  struct usb_skel *dev = container_of(work, struct usb_skel, frame_work);
+  unsigned int i;
+  int slot;
+
+  for (;;) {
+    spin_lock_irq(&dev->err_lock);
+    if (!dev->ready_count) {
+      spin_unlock_irq(&dev->err_lock);
+      break;
+    }
+    slot = dev->ready[dev->ready_head];
+    dev->ready_head = (dev->ready_head + 1) % dev->ring_depth;
+    dev->ready_count--;
+    dev->busy_slot = slot;
+    spin_unlock_irq(&dev->err_lock);
+
+    /* the frames of one transfer share its completion time */
+    for (i = 0; i < dev->ring[slot].frames; i++)
+      skel_process_frame(dev, dev->input,
+			 dev->ring[slot].data + i * FRAME_SIZE,
+			 dev->ring[slot].timestamp);
+
+    spin_lock_irq(&dev->err_lock);
+    dev->free_slots[dev->free_count++] = slot;
+    dev->busy_slot = -1;
+    spin_unlock_irq(&dev->err_lock);
+  }
+
+  /* idle: every urb is parked, ask for the next frame later */
+  spin_lock_irq(&dev->err_lock);
+  if (dev->idle && dev->streaming &&
+      dev->parked == BIT(READS_IN_FLIGHT) - 1)
+    queue_delayed_work(dev->wq, &dev->idle_work,
+		       msecs_to_jiffies(dev->params.idle_interval));
+  spin_unlock_irq(&dev->err_lock);
+}
+
+static void skel_idle_work(struct work_struct *work)
+{
+  struct usb_skel *dev = container_of(to_delayed_work(work),
+				      struct usb_skel, idle_work);
+
+  spin_lock_irq(&dev->err_lock);
+  if (dev->idle && dev->streaming)
+    skel_unpark_urbs(dev, 1);
+  spin_unlock_irq(&dev->err_lock);
+}
+
+/*
+ * Resubmit the failed frame urbs. The halt of a stalled endpoint can only
+ * be cleared with its queue empty, so all frame urbs are stopped first
+ * and resubmitted together, the parked ones too: while recovering is set
+ * neither the completion nor the idle accounting submits any of them.
+ * Their completions park them again while the device is idle.
+ */
+static void skel_recover_work(struct work_struct *work)
+{
+  struct usb_skel *dev = container_of(to_delayed_work(work),
+				      struct usb_skel, recover_work);
+  bool halted;
+  int i, rv;
+
+  spin_lock_irq(&dev->err_lock);
+  halted = dev->streaming && dev->halted;
+  dev->halted = false;
+  dev->recovering = halted;
+  spin_unlock_irq(&dev->err_lock);
+
+  if (halted) {
+    dev_warn_ratelimited(&dev->interface->dev,
+			 "bulk in endpoint stalled, clearing the halt\n");
+    for (i = 0; i < READS_IN_FLIGHT; i++)
+      usb_kill_urb(dev->frame_urbs[i]);
+    rv = usb_clear_halt(dev->udev,
+			usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+    if (rv)
+      dev_err(&dev->interface->dev,
+	      "%s - clearing the halt failed: %d\n", __func__, rv);
+  }
+
+  spin_lock_irq(&dev->err_lock);
+  if (halted) {
+    dev->recovering = false;
+    dev->failed = BIT(READS_IN_FLIGHT) - 1;
+    dev->parked = 0;
+  }
+  for (i = 0; i < READS_IN_FLIGHT && dev->streaming; i++) {
+    if (!(dev->failed & BIT(i)))
+      continue;
+    dev->failed &= ~BIT(i);
+
+    rv = usb_submit_urb(dev->frame_urbs[i], GFP_ATOMIC);
+    if (rv) {
+      dev_err_ratelimited(&dev->interface->dev,
+			  "%s - failed resubmitting read urb, error %d\n",
+			  __func__, rv);
+      skel_frame_failed(dev, i, rv);
+    }
+  }
+  spin_unlock_irq(&dev->err_lock);
+}
+
+/* Initialize input device parameters. */
+static void input_setup(struct input_dev *input_dev)
+{
+        __set_bit(EV_KEY, input_dev->evbit);
+	__set_bit(EV_ABS, input_dev->evbit);
+
+	input_set_abs_params(input_dev, ABS_MT_POSITION_X,
+			     0, SENSOR_RES_X, 0, 0);
 	input_set_abs_params(input_dev, ABS_MT_POSITION_Y,
 			     0, SENSOR_RES_Y, 0, 0);
 
@@ -811,7 +2497,8 @@ static void input_setup(struct input_dev *input_dev)
 	input_set_abs_params(input_dev, ABS_MT_ORIENTATION, 0, 1, 0, 0);
 
 	input_mt_init_slots(input_dev, MAX_CONTACTS,
-			    INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED);
+			    INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED |
+			    INPUT_MT_TRACK);
 }
 
 static int skel_probe(struct usb_interface *interface,
@@ -820,10 +2507,12 @@ static int skel_probe(struct usb_interface *interface,
 	struct usb_skel *dev;
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
-	struct input_polled_dev *poll_dev;
+	struct input_dev *input;
+	char calibration_name[64];
 	
 	size_t buffer_size;
-	int i;
+	unsigned int maxp;
+	int i, j;
 	int retval = -ENOMEM;
 	
 	/* allocate memory for our device state and initialize it */
@@ -835,13 +2524,46 @@ static int skel_probe(struct usb_interface *interface,
 	kref_init(&dev->kref);
 	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
 	mutex_init(&dev->io_mutex);
+	mutex_init(&dev->calibration_mutex);
 	spin_lock_init(&dev->err_lock);
+	dev->params.sigma_threshold = SIGMA_THRESHOLD;
+	dev->params.calibration_frames = CALIBRATION_FRAMES;
+	dev->params.calibrate_every = CALIBRATE_EVERY;
+	dev->params.line_offset = BLOB_LINE_OFFSET;
+	dev->params.max_contacts = MAX_CONTACTS;
+	dev->params.idle_after = IDLE_AFTER;
+	dev->params.idle_interval = IDLE_INTERVAL;
+	dev->params.predict_horizon = PREDICT_HORIZON;
+	dev->params.predict_alpha = PREDICT_ALPHA;
+	dev->params.predict_beta = PREDICT_BETA;
+	dev->params.window.lines = FRAME_ROWS;
+	dev->params.window.columns = FRAME_COLS;
+	dev->params_next = dev->params;
+	dev->window_tiles = ~0ULL;
+	u64_stats_init(&dev->stats.rx_syncp);
+	u64_stats_init(&dev->stats.frame_syncp);
 	init_usb_anchor(&dev->submitted);
-	init_waitqueue_head(&dev->bulk_in_wait);
+	init_waitqueue_head(&dev->capture_wait);
+	INIT_WORK(&dev->frame_work, skel_frame_work);
+	INIT_DELAYED_WORK(&dev->idle_work, skel_idle_work);
+	INIT_DELAYED_WORK(&dev->recover_work, skel_recover_work);
 
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
 	dev->frame_index = 0;
+	dev->busy_slot = -1;
+	dev->kernels = skel_pick_kernels(false);
+
+	/*
+	 * every panel has its own unbound queue: a slow frame on one of
+	 * them never delays the others, and frames of one stay in order
+	 */
+	dev->wq = alloc_workqueue("greentouch-%s", WQ_UNBOUND | WQ_HIGHPRI, 1,
+				  dev_name(&interface->dev));
+	if (!dev->wq) {
+		retval = -ENOMEM;
+		goto error;
+	}
 	/* set up the endpoint information */
 	/* use only the first bulk-in and bulk-out endpoints */
 	iface_desc = interface->cur_altsetting;
@@ -851,28 +2573,73 @@ static int skel_probe(struct usb_interface *interface,
 		if (!dev->bulk_in_endpointAddr &&
 		    usb_endpoint_is_bulk_in(endpoint)) {
 			/* we found a bulk in endpoint */
-		        buffer_size = 4160;//usb_endpoint_maxp(endpoint);
+			/*
+			 * a transfer that runs on past a frame must stop on
+			 * a packet boundary, or the device overflows the urb
+			 * mid-packet and the next frame is torn
+			 */
+			dev->frames_per_urb = clamp_t(unsigned int,
+						      frames_per_urb, 1,
+						      FRAMES_PER_URB_MAX);
+			maxp = usb_endpoint_maxp(endpoint);
+			if (dev->frames_per_urb > 1 && maxp)
+				dev->frames_per_urb = roundup(dev->frames_per_urb,
+						maxp / gcd(FRAME_SIZE, maxp));
+			buffer_size = dev->frames_per_urb * FRAME_SIZE;
 			dev->bulk_in_size = buffer_size;
 			dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-			dev->bulk_in_buffer = kzalloc(buffer_size, GFP_KERNEL);
-			dev->score_frame = kzalloc(buffer_size*2, GFP_KERNEL);
-			dev->score_frame_adjacent = kzalloc(buffer_size*2, GFP_KERNEL);
-			dev->score_last_frame_adjacent = kzalloc(buffer_size*2, GFP_KERNEL);
-			dev->sigma_frame = kzalloc(buffer_size*2, GFP_KERNEL);
-			dev->average_frame = kzalloc(buffer_size*2, GFP_KERNEL);
-			
-			
-			if (!dev->bulk_in_buffer) {
+			dev->planes = kvzalloc(sizeof(*dev->planes), GFP_KERNEL);
+			dev->labels = kcalloc(MAX_LABELS, sizeof(*dev->labels),
+					      GFP_KERNEL);
+			if (!dev->planes) {
+				dev_err(&interface->dev,
+					"Could not allocate score planes\n");
+				goto error;
+			}
+			dev->score_frame_adjacent = dev->planes->adjacent[0];
+			dev->score_last_frame_adjacent = dev->planes->adjacent[1];
+			if (!dev->labels) {
 				dev_err(&interface->dev,
-					"Could not allocate bulk_in_buffer\n");
+					"Could not allocate contact labels\n");
 				goto error;
 			}
-			dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-			if (!dev->bulk_in_urb) {
+			dev->ring_depth = clamp_t(unsigned int, ring_depth,
+						  READS_IN_FLIGHT + 2,
+						  FRAME_RING_MAX);
+			dev->ring = kcalloc(dev->ring_depth,
+					    sizeof(*dev->ring), GFP_KERNEL);
+			if (!dev->ring) {
 				dev_err(&interface->dev,
-					"Could not allocate bulk_in_urb\n");
+					"Could not allocate frame ring\n");
 				goto error;
 			}
+			for (j = 0; j < dev->ring_depth; j++) {
+				dev->ring[j].data = usb_alloc_coherent(dev->udev,
+						buffer_size, GFP_KERNEL,
+						&dev->ring[j].dma);
+				if (!dev->ring[j].data) {
+					dev_err(&interface->dev,
+						"Could not allocate frame slot\n");
+					goto error;
+				}
+			}
+			for (j = 0; j < READS_IN_FLIGHT; j++) {
+				dev->frame_urbs[j] = usb_alloc_urb(0,
+								   GFP_KERNEL);
+				if (!dev->frame_urbs[j]) {
+					dev_err(&interface->dev,
+						"Could not allocate frame urbs\n");
+					goto error;
+				}
+				/* the slot is attached by skel_ring_reset() */
+				usb_fill_bulk_urb(dev->frame_urbs[j], dev->udev,
+						  usb_rcvbulkpipe(dev->udev,
+							dev->bulk_in_endpointAddr),
+						  NULL, buffer_size,
+						  skel_frame_callback, dev);
+				dev->frame_urbs[j]->transfer_flags |=
+					URB_NO_TRANSFER_DMA_MAP;
+			}
 		}
 
 		if (!dev->bulk_out_endpointAddr &&
@@ -887,49 +2654,81 @@ static int skel_probe(struct usb_interface *interface,
 		goto error;
 	}
 
-	poll_dev = input_allocate_polled_device();
-	if (!poll_dev) {
+	input = input_allocate_device();
+	if (!input) {
 		retval = -ENOMEM;
-		printk("Error allocating polled dev");
+		dev_err(&interface->dev, "Error allocating input dev\n");
 		goto error;
 	}
-	/* Set up polled input device control structure */
-	poll_dev->private = dev;
-	poll_dev->poll_interval = POLL_INTERVAL;
-	poll_dev->poll = skel_poll;
+	/* frames are reported by frame_work as they arrive */
+	input_set_drvdata(input, dev);
+	input->open = skel_input_open;
+	input->close = skel_input_close;
 
-	input_setup(poll_dev->input);
+	input_setup(input);
         
-	poll_dev->input->name = NAME_LONG;
-	usb_to_input_id(dev->udev, &poll_dev->input->id);
+	input->name = NAME_LONG;
+	usb_to_input_id(dev->udev, &input->id);
 	usb_make_path(dev->udev, dev->phys, sizeof(dev->phys));
 	strlcat(dev->phys, "/input0", sizeof(dev->phys));
 
-	poll_dev->input->phys = dev->phys;
-	poll_dev->input->dev.parent = &interface->dev;
+	input->phys = dev->phys;
+	input->dev.parent = &interface->dev;
 	
-	dev->input = poll_dev;
+	dev->input = input;
 	
-	retval = input_register_polled_device(poll_dev);
+	retval = input_register_device(input);
 	if (retval) {
-	        printk("Error registering polled dev");
 		dev_err(&interface->dev,
-			"Unable to register polled input device.");
+			"Unable to register input device: %d\n", retval);
+		input_free_device(input);
+		dev->input = NULL;
 		goto error;
 	}
 
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
 
+	retval = sysfs_create_group(&interface->dev.kobj,
+				    &skel_attribute_group);
+	if (retval)
+		dev_warn(&interface->dev, "Unable to create sysfs attributes\n");
+	retval = sysfs_create_group(&interface->dev.kobj, &skel_stats_group);
+	if (retval)
+		dev_warn(&interface->dev, "Unable to create sysfs statistics\n");
+
+	dev->debugfs = debugfs_create_dir(dev_name(&interface->dev),
+					  skel_debugfs_root);
+	debugfs_create_file("heatmap", S_IRUSR, dev->debugfs, dev,
+			    &skel_heatmap_fops);
+	debugfs_create_file("tiles", S_IRUSR, dev->debugfs, dev,
+			    &skel_tiles_fops);
+	debugfs_create_file("latency", S_IRUSR, dev->debugfs, dev,
+			    &skel_latency_fops);
+	debugfs_create_file("stats", S_IRUSR, dev->debugfs, dev,
+			    &skel_stats_fops);
+	debugfs_create_file("inject", S_IWUSR, dev->debugfs, dev,
+			    &skel_inject_fops);
+
+	/* a saved calibration makes the first frame usable */
+	snprintf(calibration_name, sizeof(calibration_name), "greentouch/%s.cal",
+		 dev->udev->serial ? dev->udev->serial : dev_name(&dev->udev->dev));
+	kref_get(&dev->kref);
+	if (request_firmware_nowait(THIS_MODULE, FW_ACTION_NOHOTPLUG,
+				    calibration_name, &interface->dev,
+				    GFP_KERNEL, dev, skel_calibration_loaded)) {
+		dev_warn(&interface->dev, "Unable to look for %s\n",
+			 calibration_name);
+		kref_put(&dev->kref, skel_delete);
+	}
+
 	/* we can register the device now, as it is ready */
-	//retval = usb_register_dev(interface, &skel_class);
-	//if (retval) {
-	//	/* something prevented us from registering this driver */
-	//	dev_err(&interface->dev,
-	//		"Not able to get a minor for this device.\n");
-	//	usb_set_intfdata(interface, NULL);
-	//	goto error;
-	//}
+	retval = usb_register_dev(interface, &skel_class);
+	if (retval) {
+		/* the touch input works without the capture device */
+		dev_warn(&interface->dev,
+			 "Not able to get a minor for this device.\n");
+	}
 
 	/* let the user know what node this device is now attached to */
 	dev_info(&interface->dev,
@@ -950,10 +2749,13 @@ static void skel_disconnect(struct usb_interface *interface)
 	int minor = interface->minor;
 
 	dev = usb_get_intfdata(interface);
+	sysfs_remove_group(&interface->dev.kobj, &skel_stats_group);
+	sysfs_remove_group(&interface->dev.kobj, &skel_attribute_group);
+	debugfs_remove_recursive(dev->debugfs);
 	usb_set_intfdata(interface, NULL);
 
-	input_unregister_polled_device(dev->input);
-	input_free_polled_device(dev->input);
+	/* closes the device, no frame work runs after this */
+	input_unregister_device(dev->input);
 	
 	/* give back our minor */
 	usb_deregister_dev(interface, &skel_class);
@@ -962,6 +2764,8 @@ static void skel_disconnect(struct usb_interface *interface)
 	mutex_lock(&dev->io_mutex);
 	dev->interface = NULL;
 	mutex_unlock(&dev->io_mutex);
+	/* capture readers see POLLHUP */
+	wake_up_interruptible_all(&dev->capture_wait);
 
 	usb_kill_anchored_urbs(&dev->submitted);
 
@@ -978,7 +2782,6 @@ static void skel_draw_down(struct usb_skel *dev)
 	time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&dev->submitted);
-	usb_kill_urb(dev->bulk_in_urb);
 }
 
 static int skel_suspend(struct usb_interface *intf, pm_message_t message)
@@ -987,13 +2790,29 @@ static int skel_suspend(struct usb_interface *intf, pm_message_t message)
 
 	if (!dev)
 		return 0;
+
+	mutex_lock(&dev->io_mutex);
+	skel_stop_streaming(dev);
 	skel_draw_down(dev);
+	mutex_unlock(&dev->io_mutex);
+
 	return 0;
 }
 
 static int skel_resume(struct usb_interface *intf)
 {
-	return 0;
+	struct usb_skel *dev = usb_get_intfdata(intf);
+	int rv = 0;
+
+	if (!dev)
+		return 0;
+
+	mutex_lock(&dev->io_mutex);
+	if (dev->input_opened)
+		rv = skel_start_streaming(dev);
+	mutex_unlock(&dev->io_mutex);
+
+	return rv;
 }
 
 static int skel_pre_reset(struct usb_interface *intf)
@@ -1001,6 +2820,7 @@ static int skel_pre_reset(struct usb_interface *intf)
 	struct usb_skel *dev = usb_get_intfdata(intf);
 
 	mutex_lock(&dev->io_mutex);
+	skel_stop_streaming(dev);
 	skel_draw_down(dev);
 
 	return 0;
@@ -1012,6 +2832,9 @@ static int skel_post_reset(struct usb_interface *intf)
 
 	/* we are sure no URBs are active - no locking needed */
 	dev->errors = -EPIPE;
+	skel_restore_commands(dev);
+	if (dev->input_opened)
+		skel_start_streaming(dev);
 	mutex_unlock(&dev->io_mutex);
 
 	return 0;
@@ -1029,6 +2852,26 @@ static struct usb_driver skel_driver = {
 	.supports_autosuspend = 1,
 };
 
-module_usb_driver(skel_driver);
+static int __init skel_init(void)
+{
+	int retval;
+
+	skel_debugfs_root = debugfs_create_dir("greentouch", NULL);
+
+	retval = usb_register(&skel_driver);
+	if (retval)
+		debugfs_remove_recursive(skel_debugfs_root);
+
+	return retval;
+}
+
+static void __exit skel_exit(void)
+{
+	usb_deregister(&skel_driver);
+	debugfs_remove_recursive(skel_debugfs_root);
+}
+
+module_init(skel_init);
+module_exit(skel_exit);
 
 MODULE_LICENSE("GPL");
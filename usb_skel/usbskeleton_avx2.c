@@ -0,0 +1,10 @@
+/*
+ * GreenTouch scoring kernels, AVX2 build of usbskeleton_simd.c
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ */
+
+#define SKEL_SIMD_ISA avx2
+#include "usbskeleton_simd.c"
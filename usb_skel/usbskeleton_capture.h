@@ -0,0 +1,53 @@
+/*
+ * Raw frame capture of the GreenTouch foil, shared with userspace.
+ *
+ * The skel%d character device maps a read-only ring of timestamped
+ * frames: a header at offset 0, then nr_frames records of frame_stride
+ * bytes starting at header_size. Frame number seq lives in record
+ * seq % nr_frames. The driver stores head, the number of the next frame,
+ * after each record is complete; records head - nr_frames to head - 1
+ * can be read.
+ *
+ * A record is being rewritten while its sequence is
+ * GREENTOUCH_CAPTURE_BUSY. Readers check that sequence holds the expected
+ * frame number before and after copying a record, and discard it
+ * otherwise. poll() reports POLLIN when head moved since the last time it
+ * did for this file.
+ */
+
+#ifndef _USBSKELETON_CAPTURE_H
+#define _USBSKELETON_CAPTURE_H
+
+#include <linux/types.h>
+
+#define GREENTOUCH_CAPTURE_MAGIC	0x50435447	/* "GTCP" */
+#define GREENTOUCH_CAPTURE_VERSION	1
+#define GREENTOUCH_CAPTURE_ROWS		64
+#define GREENTOUCH_CAPTURE_COLS		64
+#define GREENTOUCH_CAPTURE_CELLS	(GREENTOUCH_CAPTURE_ROWS * GREENTOUCH_CAPTURE_COLS)
+
+#define GREENTOUCH_CAPTURE_BUSY		0xffffffff
+
+/* record flags */
+#define GREENTOUCH_CAPTURE_SCORES	0x1	/* score holds the smoothed scores */
+
+struct greentouch_capture_header {
+	__u32 magic;
+	__u32 version;
+	__u32 header_size;	/* offset of the first record */
+	__u32 frame_stride;	/* bytes from one record to the next */
+	__u32 nr_frames;
+	__u32 rows;
+	__u32 cols;
+	__u32 head;		/* number of the next frame to be written */
+};
+
+struct greentouch_capture_frame {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC, end of the transfer */
+	__u32 sequence;		/* frame number, or GREENTOUCH_CAPTURE_BUSY */
+	__u32 flags;
+	__u8 raw[GREENTOUCH_CAPTURE_CELLS];	/* cells, row after row */
+	__u16 score[GREENTOUCH_CAPTURE_CELLS];	/* same order, if flagged */
+};
+
+#endif
@@ -0,0 +1,687 @@
+/*
+ * GreenTouch frame pipeline
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Calibration, scoring and contact extraction of one frame, shared by the
+ * driver and the userspace replay tool (tools/greentouch_replay.c).
+ */
+
+#include "usbskeleton_pipeline.h"
+
+/*
+ * Per-cell kernels. These scalar versions are the reference, the vector
+ * builds of usbskeleton_simd.c are used instead when the CPU has them.
+ */
+static void skel_accumulate_scalar(const u8 *frame, u32 *sum, u32 *sumsq,
+				   unsigned int n)
+{
+	unsigned int k;
+
+	for (k = 0; k < n; k++) {
+		sum[k] += frame[k];
+		sumsq[k] += frame[k] * frame[k];
+	}
+}
+
+static void skel_score_scalar(const u8 *frame, const u8 *average,
+			      const u32 *recip, u16 *score, unsigned int n)
+{
+	unsigned int k;
+	u32 difference;
+
+	for (k = 0; k < n; k++) {
+		if (frame[k] < average[k])
+			difference = average[k] - frame[k];
+		else
+			difference = frame[k] - average[k];
+		score[k] = (difference * recip[k]) >> 16;
+	}
+}
+
+const struct skel_kernels skel_scalar_kernels = {
+	.name = "scalar",
+	.accumulate = skel_accumulate_scalar,
+	.score = skel_score_scalar,
+};
+
+/*
+ * The division by sigma is done as a multiplication: with
+ * recip = ceil(65536 / sigma), (difference * recip) >> 16 equals
+ * difference / sigma for every difference below 256.
+ */
+void skel_update_recip(const unsigned short *sigma_frame,
+		       unsigned int *recip_frame)
+{
+	int k;
+
+	for (k = 0; k < FRAME_CELLS; k++)
+		recip_frame[k] = DIV_ROUND_UP(65536, sigma_frame[k]);
+}
+
+/* tile of cell (row i, column j) */
+#define ROI_TILE_OF(i, j) (((i) / ROI_TILE) * ROI_TILES_X + (j) / ROI_TILE)
+
+/* activation level of the tiles of tile row @ty, from the noise estimate */
+void skel_roi_update_gates(const unsigned short *sigma_frame,
+			   struct skel_roi *roi, int ty,
+			   const struct skel_pipeline_options *options)
+{
+	const unsigned int active = ROI_ACTIVE_SCORE(options->threshold);
+	unsigned int sigma[ROI_TILES_X];
+	int i, j, tx;
+
+	for (tx = 0; tx < ROI_TILES_X; tx++)
+		sigma[tx] = U16_MAX;
+	for (i = ty * ROI_TILE; i < (ty + 1) * ROI_TILE; i++)
+		for (j = 0; j < FRAME_COLS; j++) {
+			tx = j / ROI_TILE;
+			sigma[tx] = min_t(unsigned int, sigma[tx],
+					  sigma_frame[FRAME_INDEX(i, j, options->line_offset)]);
+		}
+	/* the least noisy cell of a tile activates it first */
+	for (tx = 0; tx < ROI_TILES_X; tx++)
+		roi->gate[ty * ROI_TILES_X + tx] =
+			min_t(unsigned int, sigma[tx] * active, U16_MAX);
+}
+
+/*
+ * Coarse pass: tiles where some cell may score ROI_ACTIVE_SCORE, from the
+ * per tile maximum of |current - average|. Each row of cells is
+ * contiguous in the frame, the FRAME_INDEX wrap falls between rows.
+ */
+static u64 skel_roi_active(const unsigned char *current_frame,
+			   const unsigned char *average_frame,
+			   const struct skel_roi *roi, int line)
+{
+	const unsigned char *cur;
+	const unsigned char *avg;
+	unsigned int peak[ROI_TILES_X];
+	unsigned int d, m;
+	u64 active = 0;
+	int ty, tx, i, k, t;
+
+	for (ty = 0; ty < ROI_TILES_Y; ty++) {
+		memset(peak, 0, sizeof(peak));
+		for (i = ty * ROI_TILE; i < (ty + 1) * ROI_TILE; i++) {
+			cur = current_frame + FRAME_INDEX(i, 0, line);
+			avg = average_frame + FRAME_INDEX(i, 0, line);
+			for (tx = 0; tx < ROI_TILES_X; tx++) {
+				m = peak[tx];
+				for (k = tx * ROI_TILE; k < (tx + 1) * ROI_TILE; k++) {
+					d = abs((int)cur[k] - (int)avg[k]);
+					m = max(m, d);
+				}
+				peak[tx] = m;
+			}
+		}
+		for (tx = 0; tx < ROI_TILES_X; tx++) {
+			t = ty * ROI_TILES_X + tx;
+			if (peak[tx] >= roi->gate[t])
+				active |= BIT_ULL(t);
+		}
+	}
+
+	return active;
+}
+
+/* @tiles and their eight neighbours */
+u64 skel_roi_dilate(u64 tiles)
+{
+	/* tiles of the first and last column */
+	const u64 left = 0x0101010101010101ULL;
+	const u64 right = 0x8080808080808080ULL;
+
+	BUILD_BUG_ON(ROI_TILES_X != 8 || ROI_TILES_Y != 8);
+
+	tiles |= ((tiles << 1) & ~left) | ((tiles >> 1) & ~right);
+	return tiles | (tiles << ROI_TILES_X) | (tiles >> ROI_TILES_X);
+}
+
+/* zero @tiles of a score plane whose row 0, column 0 is at @plane */
+static void skel_roi_clear(unsigned short *plane, int stride, u64 tiles)
+{
+	unsigned short *cell;
+	int t, i;
+
+	while (tiles) {
+		t = __ffs64(tiles);
+		tiles &= tiles - 1;
+		cell = plane + (t / ROI_TILES_X) * ROI_TILE * stride +
+			(t % ROI_TILES_X) * ROI_TILE;
+		for (i = 0; i < ROI_TILE; i++, cell += stride)
+			memset(cell, 0, ROI_TILE * sizeof(*cell));
+	}
+}
+
+/* next run of consecutive set bits of @row at or after @*from, as [start, end) */
+static bool skel_roi_run(unsigned int row, int *from, int *start)
+{
+	int tx = *from;
+
+	while (tx < ROI_TILES_X && !(row & BIT(tx)))
+		tx++;
+	if (tx == ROI_TILES_X)
+		return false;
+	*start = tx;
+	while (tx < ROI_TILES_X && (row & BIT(tx)))
+		tx++;
+	*from = tx;
+	return true;
+}
+
+/* tiles of tile row @ty in @tiles, tile column tx on bit tx */
+#define ROI_ROW(tiles, ty) \
+	((unsigned int)((tiles) >> ((ty) * ROI_TILES_X)) & (BIT(ROI_TILES_X) - 1))
+
+/*
+ * Scoring stage: distance of each cell of @tiles to its baseline, in
+ * units of the cell noise. score_frame is indexed by SCORE_INDEX, the
+ * frame and calibration planes by FRAME_INDEX;
+ * a row of tiles is scored with one kernel call per run of tiles.
+ */
+void skel_score_tiles(const struct skel_kernels *kernels,
+		      const unsigned char *current_frame,
+		      const unsigned char *average_frame,
+		      const unsigned int *recip_frame,
+		      unsigned short *score_frame, u64 tiles,
+		      const struct skel_pipeline_options *options)
+{
+	unsigned int row, first;
+	int ty, tx, start, i, j;
+
+	kernels = skel_kernels_begin(kernels);
+	for (ty = 0; ty < ROI_TILES_Y; ty++) {
+		row = ROI_ROW(tiles, ty);
+		tx = 0;
+		while (skel_roi_run(row, &tx, &start)) {
+			j = start * ROI_TILE;
+			for (i = ty * ROI_TILE; i < (ty + 1) * ROI_TILE; i++) {
+				first = FRAME_INDEX(i, j, options->line_offset);
+				kernels->score(current_frame + first,
+					       average_frame + first,
+					       recip_frame + first,
+					       score_frame + SCORE_INDEX(i, j),
+					       (tx - start) * ROI_TILE);
+			}
+		}
+	}
+	skel_kernels_end(kernels);
+}
+
+/*
+ * Neighbourhood stage: 3x3 box sum of score_frame over rows [i0, i1) and
+ * columns [j0, j1); the border of score_frame makes cells outside the
+ * sensor count as zero. The filter is separable: a sliding sum along each
+ * row goes to scratch, which has the same layout, then three rows of
+ * scratch are added per output row, which is five loads per cell instead
+ * of nine.
+ */
+static void skel_box_filter(const unsigned short *score_frame,
+			    unsigned short *score_frame_adjacent,
+			    unsigned short *scratch,
+			    int i0, int i1, int j0, int j1)
+{
+	const unsigned short *in;
+	unsigned short *out;
+	unsigned int sum;
+	int i, j;
+
+	/* border rows included, their sums are zero */
+	for (i = i0 - 1; i < i1 + 1; i++) {
+		in = score_frame + SCORE_INDEX(i, 0);
+		out = scratch + SCORE_INDEX(i, 0);
+		sum = in[j0 - 1] + in[j0];
+		for (j = j0; j < j1; j++) {
+			sum += in[j + 1];
+			out[j] = sum;
+			sum -= in[j - 1];
+		}
+	}
+
+	for (i = i0; i < i1; i++) {
+		in = scratch + SCORE_INDEX(i, 0);
+		out = score_frame_adjacent + i * FRAME_COLS;
+		for (j = j0; j < j1; j++)
+			out[j] = in[j - SCORE_STRIDE] + in[j] +
+				in[j + SCORE_STRIDE];
+	}
+}
+
+/*
+ * Box filter and temporal smoothing with the previous frame over @tiles.
+ * Returns the tiles where a cell crosses @threshold. The smoothed scores
+ * are added to @summary.
+ */
+u64 skel_filter_tiles(const unsigned short *score_frame,
+		      unsigned short *score_frame_adjacent,
+		      const unsigned short *score_last_frame_adjacent,
+		      unsigned short *scratch,
+		      unsigned short threshold, u64 tiles,
+		      struct skel_score_summary *summary)
+{
+	unsigned int row, cell, sum = 0, peak = 0;
+	u64 triggered = 0;
+	int ty, tx, start, i, j;
+
+	for (ty = 0; ty < ROI_TILES_Y; ty++) {
+		row = ROI_ROW(tiles, ty);
+		tx = 0;
+		while (skel_roi_run(row, &tx, &start)) {
+			skel_box_filter(score_frame, score_frame_adjacent, scratch,
+					ty * ROI_TILE, (ty + 1) * ROI_TILE,
+					start * ROI_TILE, tx * ROI_TILE);
+
+			for (i = ty * ROI_TILE; i < (ty + 1) * ROI_TILE; i++)
+				for (j = start * ROI_TILE; j < tx * ROI_TILE; j++) {
+					cell = i * FRAME_COLS + j;
+					score_frame_adjacent[cell] =
+						(score_frame_adjacent[cell] +
+						 score_last_frame_adjacent[cell]) / 2;
+					if (score_frame_adjacent[cell] > threshold)
+						triggered |= BIT_ULL(ROI_TILE_OF(i, j));
+					sum += score_frame_adjacent[cell];
+					peak = max_t(unsigned int, peak,
+						     score_frame_adjacent[cell]);
+				}
+		}
+	}
+
+	summary->sum += sum;
+	summary->peak = max_t(unsigned int, summary->peak, peak);
+	return triggered;
+}
+
+/*
+ * Choose the tiles going through the pipeline this frame: the active
+ * ones, those which held a contact last frame so it can fade out, and
+ * their neighbours, inside the scan window. Stale tiles of the planes about to be written are
+ * zeroed so that skipped tiles read as zero score.
+ */
+u64 skel_roi_select(const unsigned char *current_frame,
+		    const unsigned char *average_frame,
+		    unsigned short *score_frame,
+		    unsigned short *score_frame_adjacent,
+		    struct skel_roi *roi,
+		    const struct skel_pipeline_options *options)
+{
+	u64 active, tiles;
+	int t;
+
+	if (options->roi) {
+		active = skel_roi_active(current_frame, average_frame, roi,
+					 options->line_offset);
+		tiles = skel_roi_dilate(active | roi->triggered);
+	} else {
+		active = tiles = ~0ULL;
+	}
+	/* cells the sensor does not scan are never scored */
+	active &= options->window;
+	tiles &= options->window;
+
+	skel_roi_clear(score_frame + SCORE_INDEX(0, 0), SCORE_STRIDE,
+		       roi->score_tiles & ~tiles);
+	skel_roi_clear(score_frame_adjacent, FRAME_COLS,
+		       roi->adjacent_tiles & ~tiles);
+	roi->score_tiles = tiles;
+	roi->adjacent_tiles = tiles;
+
+	roi->tiles_active += hweight64(active);
+	roi->tiles_processed += hweight64(tiles);
+	if (!tiles)
+		roi->idle_frames++;
+	for (t = 0; t < ROI_TILES; t++)
+		if (tiles & BIT_ULL(t))
+			roi->tile_hits[t]++;
+
+	return tiles;
+}
+
+/*
+ * End of the calibration: mean and deviation of every cell from the
+ * sums over @n frames, in one pass. sigma stays on the scale of the
+ * mean absolute deviation SIGMA_THRESHOLD was tuned for, which is 4/5 of
+ * the standard deviation for gaussian noise. The running baseline starts
+ * from the exact 1/256 values.
+ */
+void skel_calibrate_finish(const u32 *calib_sum, const u32 *calib_sumsq,
+			   unsigned char *average_frame,
+			   unsigned short *sigma_frame,
+			   unsigned short *average_q8,
+			   unsigned short *sigma_q8, unsigned int n)
+{
+	u64 spread;
+	int k;
+
+	/* 64 bit all along: n * sumsq, sum << 8 and spread << 10 need it */
+	for (k = 0; k < FRAME_CELLS; k++) {
+		/* n * standard deviation */
+		spread = int_sqrt64((u64)n * calib_sumsq[k] -
+				    (u64)calib_sum[k] * calib_sum[k]);
+		average_q8[k] = div_u64(((u64)calib_sum[k] << 8) + n / 2, n);
+		sigma_q8[k] = div_u64((spread * 4 << 8) + 5 * n / 2, 5 * n);
+
+		average_frame[k] = min((average_q8[k] + 128) >> 8, 255);
+		sigma_frame[k] = max((sigma_q8[k] + 128) >> 8, 1);
+	}
+}
+
+/*
+ * 1/2^BASELINE_SHIFT of @d rounded to the nearest, halves away from zero:
+ * a plain shift rounds toward minus infinity and pulls the averages down.
+ */
+static inline int skel_ema_step(int d)
+{
+	const int half = 1 << (BASELINE_SHIFT - 1);
+
+	return d >= 0 ? (d + half) >> BASELINE_SHIFT :
+			-((-d + half) >> BASELINE_SHIFT);
+}
+
+/*
+ * Continuous calibration: exponential moving average of the baseline and
+ * of the mean absolute deviation around it, in 1/256 units, over the
+ * cells of tile row @ty outside the @skip tiles. The integer planes used
+ * by the scoring stage follow.
+ */
+void skel_track_baseline(const unsigned char *current_frame,
+			 unsigned char *average_frame,
+			 unsigned short *sigma_frame,
+			 unsigned int *recip_frame,
+			 unsigned short *average_q8,
+			 unsigned short *sigma_q8, int ty, u64 skip,
+			 const struct skel_pipeline_options *options)
+{
+	unsigned int row = ROI_ROW(skip, ty);
+	int i, j, k, d;
+
+	for (i = ty * ROI_TILE; i < (ty + 1) * ROI_TILE; i++)
+		for (j = 0; j < FRAME_COLS; j++) {
+			if (row & BIT(j / ROI_TILE))
+				continue;
+			k = FRAME_INDEX(i, j, options->line_offset);
+			d = (current_frame[k] << 8) - average_q8[k];
+			average_q8[k] += skel_ema_step(d);
+			sigma_q8[k] += skel_ema_step(abs(d) - sigma_q8[k]);
+
+			average_frame[k] = min((average_q8[k] + 128) >> 8, 255);
+			sigma_frame[k] = max((sigma_q8[k] + 128) >> 8, 1);
+			recip_frame[k] = DIV_ROUND_UP(65536, sigma_frame[k]);
+		}
+}
+
+/* root of label @x, halving the path on the way */
+static u16 skel_label_find(struct blob_label *labels, u16 x)
+{
+	while (labels[x].parent != x) {
+		labels[x].parent = labels[labels[x].parent].parent;
+		x = labels[x].parent;
+	}
+	return x;
+}
+
+/* merge the blobs of labels @a and @b, the lower root survives */
+static u16 skel_label_union(struct blob_label *labels, u16 a, u16 b)
+{
+	struct blob_label *root, *child;
+
+	a = skel_label_find(labels, a);
+	b = skel_label_find(labels, b);
+	if (a == b)
+		return a;
+	if (b < a)
+		swap(a, b);
+
+	root = &labels[a];
+	child = &labels[b];
+	child->parent = a;
+	root->area += child->area;
+	root->sum += child->sum;
+	root->sum_x += child->sum_x;
+	root->sum_y += child->sum_y;
+	root->min_x = min(root->min_x, child->min_x);
+	root->max_x = max(root->max_x, child->max_x);
+	root->min_y = min(root->min_y, child->min_y);
+	root->max_y = max(root->max_y, child->max_y);
+	if (child->peak > root->peak) {
+		root->peak = child->peak;
+		root->peak_x = child->peak_x;
+		root->peak_y = child->peak_y;
+	}
+
+	return a;
+}
+
+/*
+ * Contact stage: single pass, two row connected component labelling of
+ * the cells scoring above @threshold (8-connectivity). Blob statistics
+ * are accumulated on the union-find roots while scanning, the work is
+ * O(cells) whatever the number of contacts. At most @max_contacts blobs are
+ * returned in @contacts, in raster order of their first cell.
+ */
+int skel_label_contacts(const unsigned short *score_frame_adjacent,
+			unsigned short threshold,
+			struct blob_label *labels,
+			struct touch_contact *contacts, int max_contacts)
+{
+	u16 rows[2][FRAME_COLS];
+	u16 *prev = rows[0], *cur = rows[1];
+	u16 label, next = 1;
+	struct blob_label *l;
+	unsigned int score;
+	int i, j, n, count;
+
+	memset(prev, 0, sizeof(rows[0]));
+	for (i = 0; i < FRAME_ROWS; i++) {
+		for (j = 0; j < FRAME_COLS; j++) {
+			score = score_frame_adjacent[i * FRAME_COLS + j];
+			cur[j] = 0;
+			if (score <= threshold)
+				continue;
+
+			/* already labelled neighbours: W, NW, N, NE */
+			label = j > 0 ? cur[j - 1] : 0;
+			for (n = max(j - 1, 0); n <= min(j + 1, FRAME_COLS - 1); n++) {
+				if (!prev[n])
+					continue;
+				label = label ? skel_label_union(labels, label, prev[n]) :
+					prev[n];
+			}
+
+			if (label) {
+				label = skel_label_find(labels, label);
+			} else {
+				if (next == MAX_LABELS)
+					continue;
+				label = next++;
+				l = &labels[label];
+				memset(l, 0, sizeof(*l));
+				l->parent = label;
+				l->min_x = l->max_x = j;
+				l->min_y = l->max_y = i;
+			}
+
+			cur[j] = label;
+			l = &labels[label];
+			l->area++;
+			l->sum += score;
+			l->sum_x += (u64)score * j;
+			l->sum_y += (u64)score * i;
+			l->min_x = min_t(u8, l->min_x, j);
+			l->max_x = max_t(u8, l->max_x, j);
+			l->max_y = i;
+			if (score > l->peak) {
+				l->peak = score;
+				l->peak_x = j;
+				l->peak_y = i;
+			}
+		}
+		swap(prev, cur);
+	}
+
+	count = 0;
+	for (label = 1; label < next && count < max_contacts; label++) {
+		l = &labels[label];
+		if (l->parent != label)
+			continue;
+		contacts[count].x = l->min_x;
+		contacts[count].y = l->min_y;
+		contacts[count].w = l->max_x - l->min_x + 1;
+		contacts[count].h = l->max_y - l->min_y + 1;
+		contacts[count].area = l->area;
+		contacts[count].sum = l->sum;
+		contacts[count].cx = div_u64(l->sum_x << 8, l->sum);
+		contacts[count].cy = div_u64(l->sum_y << 8, l->sum);
+		contacts[count].peak_x = l->peak_x;
+		contacts[count].peak_y = l->peak_y;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Sub-cell offset of the vertex of the parabola through @left, @peak and
+ * @right, in 1/256 cell. @peak is the maximum of the three.
+ */
+static int skel_peak_offset(int left, int peak, int right)
+{
+	int curvature = left - 2 * peak + right;
+
+	if (curvature >= 0)
+		return 0;
+	return clamp(128 * (left - right) / curvature, -128, 128);
+}
+
+/*
+ * Centroid stage: position of each contact in sensor resolution, from
+ * its score weighted centre of mass or, with peak_fit, from a parabolic
+ * fit of the scores around its peak cell. Cell j covers [j, j + 1), the
+ * +128 moves the fixed point position to the centre of the cell.
+ */
+void skel_position_contacts(const unsigned short *score_frame_adjacent,
+			    struct touch_contact *contacts, int count,
+			    bool fit)
+{
+	const unsigned short *row;
+	struct touch_contact *contact;
+	int i, x, y, px, py;
+
+	for (i = 0; i < count; i++) {
+		contact = &contacts[i];
+		x = contact->cx;
+		y = contact->cy;
+
+		if (fit) {
+			px = contact->peak_x;
+			py = contact->peak_y;
+			row = score_frame_adjacent + py * FRAME_COLS;
+			/* on the edge there is only one side, keep the centroid */
+			if (px > 0 && px < FRAME_COLS - 1)
+				x = (px << 8) + skel_peak_offset(row[px - 1],
+						row[px], row[px + 1]);
+			if (py > 0 && py < FRAME_ROWS - 1)
+				y = (py << 8) + skel_peak_offset(row[px - FRAME_COLS],
+						row[px], row[px + FRAME_COLS]);
+		}
+
+		contact->pos_x = (x + 128) * SENSOR_RES_X / (FRAME_COLS << 8);
+		contact->pos_y = (y + 128) * SENSOR_RES_Y / (FRAME_ROWS << 8);
+	}
+}
+
+/* There is an offset of 96 bits
+   Stage 1: sum the cells and their squares over n = calibration_frames frames
+   Stage 2: derive average and sigma from the sums
+   Stage 3: score, box filter, smooth and look for contacts
+   Returns the number of contacts found.
+ */
+int normalize(unsigned char *current_frame,
+	      unsigned short *score_frame,
+	      unsigned short *score_frame_adjacent,
+	      unsigned short *score_last_frame_adjacent,
+	      unsigned char *average_frame,
+	      unsigned short *sigma_frame,
+	      unsigned int *recip_frame,
+	      u32 *calib_sum,
+	      u32 *calib_sumsq,
+	      unsigned short *box_scratch,
+	      const struct skel_kernels *kernels,
+	      int frame_index,
+	      bool calibrated,
+	      const struct skel_pipeline_options *options,
+	      unsigned short *average_q8,
+	      unsigned short *sigma_q8,
+	      struct skel_roi *roi,
+	      struct blob_label *labels,
+	      struct touch_contact *touch_contacts,
+	      struct skel_score_summary *summary,
+	      u64 *scored_at){
+  int retval, index, contact_index;
+  u64 tiles;
+  
+  unsigned short sigma_threshold_factor;
+  const struct skel_kernels *k;
+  
+  sigma_threshold_factor = options->threshold;
+  contact_index = 0;
+  retval = 0;
+
+  
+  /* calibration stages, on whole planes */
+  if(!calibrated && frame_index < options->calibration_frames){
+    if (frame_index == 0){
+      memset(calib_sum, 0, FRAME_CELLS*sizeof(*calib_sum));
+      memset(calib_sumsq, 0, FRAME_CELLS*sizeof(*calib_sumsq));
+    }
+    k = skel_kernels_begin(kernels);
+    k->accumulate(current_frame, calib_sum, calib_sumsq, FRAME_CELLS);
+    skel_kernels_end(k);
+  }else if(!calibrated && frame_index == options->calibration_frames){
+    skel_calibrate_finish(calib_sum, calib_sumsq, average_frame, sigma_frame,
+			  average_q8, sigma_q8, options->calibration_frames);
+    skel_update_recip(sigma_frame, recip_frame);
+    for(index=0;index<ROI_TILES_Y;index++)
+      skel_roi_update_gates(sigma_frame, roi, index, options);
+  }
+
+  if(calibrated){
+    summary->sum = 0;
+    summary->peak = 0;
+    tiles = skel_roi_select(current_frame, average_frame,
+			    score_frame, score_frame_adjacent, roi, options);
+    if(tiles){
+      skel_score_tiles(kernels, current_frame, average_frame, recip_frame,
+		       score_frame, tiles, options);
+      roi->triggered = skel_filter_tiles(score_frame, score_frame_adjacent,
+					 score_last_frame_adjacent, box_scratch,
+					 sigma_threshold_factor, tiles, summary);
+    }else{
+      roi->triggered = 0;
+    }
+
+    /* one tile row of the baseline per frame, away from the contacts */
+    if(options->continuous){
+      index = frame_index % ROI_TILES_Y;
+      skel_track_baseline(current_frame, average_frame, sigma_frame, recip_frame,
+			  average_q8, sigma_q8, index,
+			  skel_roi_dilate(roi->triggered), options);
+      skel_roi_update_gates(sigma_frame, roi, index, options);
+    }
+
+    /* idle frame: nothing to score, every plane is already zero */
+    *scored_at = ktime_get_ns();
+    if(!tiles)
+      return 0;
+
+    contact_index = skel_label_contacts(score_frame_adjacent, sigma_threshold_factor,
+					labels, touch_contacts, options->max_contacts);
+    skel_position_contacts(score_frame_adjacent, touch_contacts, contact_index,
+			   options->peak_fit);
+    retval = contact_index;
+  }
+
+  return retval;
+}
@@ -0,0 +1,249 @@
+/*
+ * GreenTouch frame pipeline: calibration, scoring and contact extraction
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Everything here works on plain arrays owned by the caller and never
+ * allocates. The driver runs it on every frame; the replay tool in
+ * tools/ builds the same file in userspace.
+ */
+
+#ifndef _USBSKELETON_PIPELINE_H
+#define _USBSKELETON_PIPELINE_H
+
+#include "usbskeleton_compat.h"
+#include "usbskeleton_simd.h"
+
+/* sensor resolution */
+#define SENSOR_RES_X 1920
+#define SENSOR_RES_Y 1080
+/* room for contacts, the max_contacts option stays below */
+#define MAX_CONTACTS 32
+/*
+ * defaults of the tunable options: SIGMA_THRESHOLD, CALIBRATION_FRAMES
+ * (at most 66051 for the u32 sums), CALIBRATE_EVERY and BLOB_LINE_OFFSET
+ */
+#define SIGMA_THRESHOLD 275
+#define CALIBRATION_FRAMES 255
+#define CALIBRATE_EVERY 7000
+#define BLOB_LINE_OFFSET 0
+/* continuous calibration: a cell moves 1/2^BASELINE_SHIFT of the way every ROI_TILES_Y frames */
+#define BASELINE_SHIFT 6
+
+/* frame layout: FRAME_HEADER_SIZE unknown octets, then 64x64 cells */
+#define FRAME_SIZE 4160
+#define FRAME_HEADER_SIZE 64
+#define FRAME_ROWS 64
+#define FRAME_COLS 64
+#define FRAME_CELLS (FRAME_ROWS*FRAME_COLS)
+/*
+ * provisional labels of one frame: 8-connected blobs need a background
+ * cell on their left, at most FRAME_COLS/2 new labels per row
+ */
+#define MAX_LABELS (FRAME_CELLS/2+1)
+/*
+ * region of interest: the frame is split in 8x8 tiles, idle tiles count
+ * as zero score. 3x3 boxes of cells all under ROI_ACTIVE_SCORE cannot
+ * cross the threshold, a tile is active once one of its cells reaches it.
+ */
+#define ROI_TILE 8
+#define ROI_TILES_X (FRAME_COLS/ROI_TILE)
+#define ROI_TILES_Y (FRAME_ROWS/ROI_TILE)
+#define ROI_TILES (ROI_TILES_X*ROI_TILES_Y)
+#define ROI_ACTIVE_SCORE(threshold) ((threshold)/9+1)
+/*
+ * offset of cell (row i, column j) in a frame and the calibration planes,
+ * with frame line @line shown as row 0
+ */
+#define FRAME_INDEX(i, j, line) (((j)+(i)*FRAME_COLS+FRAME_HEADER_SIZE+FRAME_COLS*(line))%FRAME_CELLS)
+/*
+ * the score plane and the box filter scratch have a border of one zero
+ * cell all around, so the 3x3 box needs no bounds checks: cell (row i,
+ * column j) is at SCORE_INDEX(i, j) for i in [-1, FRAME_ROWS] and j in
+ * [-1, FRAME_COLS]
+ */
+#define SCORE_STRIDE (FRAME_COLS+2)
+#define SCORE_PLANE_CELLS ((FRAME_ROWS+2)*SCORE_STRIDE)
+#define SCORE_INDEX(i, j) (((i)+1)*SCORE_STRIDE+(j)+1)
+
+/*
+ * Working planes of a device, in one allocation. The planes every scored
+ * frame goes through come first and take 54KB together; the baseline
+ * planes follow, then the calibration sums, only used while calibrating.
+ */
+struct skel_planes {
+	unsigned short		score[SCORE_PLANE_CELLS] ____cacheline_aligned;
+	unsigned short		box_scratch[SCORE_PLANE_CELLS] ____cacheline_aligned;
+	/* smoothed scores of this frame and the last one, the owner swaps them */
+	unsigned short		adjacent[2][FRAME_CELLS] ____cacheline_aligned;
+	unsigned int		recip[FRAME_CELLS] ____cacheline_aligned;
+	unsigned char		average[FRAME_CELLS] ____cacheline_aligned;
+	unsigned short		sigma[FRAME_CELLS] ____cacheline_aligned;
+	unsigned short		average_q8[FRAME_CELLS] ____cacheline_aligned;
+	unsigned short		sigma_q8[FRAME_CELLS] ____cacheline_aligned;
+	u32			calib_sum[FRAME_CELLS] ____cacheline_aligned;
+	u32			calib_sumsq[FRAME_CELLS] ____cacheline_aligned;
+};
+
+struct touch_contact {
+  int x;
+  int y;
+  int h;
+  int w;
+  int area;	/* triggered cells */
+  int sum;	/* sum of their scores */
+  int cx;	/* score weighted centroid, in 1/256 cell */
+  int cy;
+  int peak_x;	/* highest scoring cell */
+  int peak_y;
+  int pos_x;	/* reported position, in sensor resolution */
+  int pos_y;
+};
+
+/*
+ * Union-find entry of the contact labeller. Statistics are only valid
+ * on a root (parent == own label).
+ */
+struct blob_label {
+	u16			parent;
+	u16			area;
+	u32			sum;
+	u64			sum_x;		/* sum of score * column */
+	u64			sum_y;		/* sum of score * row */
+	u16			peak;		/* highest score and its cell */
+	u8			peak_x, peak_y;
+	u8			min_x, max_x, min_y, max_y;
+};
+
+/*
+ * Region of interest state. Tile masks have bit ty * ROI_TILES_X + tx set
+ * for tile row ty, column tx; score planes are zero outside their mask.
+ */
+struct skel_roi {
+	u64			score_tiles;		/* tiles written in score_frame */
+	u64			adjacent_tiles;		/* ... in score_frame_adjacent */
+	u64			last_tiles;		/* ... in score_last_frame_adjacent */
+	u64			triggered;		/* tiles over the threshold last frame */
+	u16			gate[ROI_TILES];	/* |current - average| activating a tile */
+	unsigned long		idle_frames;		/* scored frames without active tile */
+	unsigned long		tiles_active;		/* active tiles, all frames */
+	unsigned long		tiles_processed;	/* active tiles and halo, all frames */
+	u32			tile_hits[ROI_TILES];	/* frames each tile was processed */
+};
+
+/* smoothed scores of one frame, the cells skipped by the ROI count as zero */
+struct skel_score_summary {
+	u32			sum;		/* at most FRAME_CELLS * U16_MAX */
+	u16			peak;
+};
+
+/* knobs of the pipeline, sampled once per frame */
+struct skel_pipeline_options {
+	bool			roi;		/* only score the active tiles */
+	bool			peak_fit;	/* parabolic peak positions */
+	bool			continuous;	/* track the baseline while scoring */
+	u64			window;		/* tiles the sensor scans */
+	u16			threshold;	/* smoothed score of a touched cell */
+	u16			calibration_frames;	/* frames averaged by the calibration */
+	u8			line_offset;	/* frame line shown as row 0 */
+	u8			max_contacts;	/* at most MAX_CONTACTS */
+};
+
+extern const struct skel_kernels skel_scalar_kernels;
+
+/*
+ * Enter and leave the FPU/NEON context of @k. In the driver, begin
+ * falls back to the scalar kernels where the vector unit is not usable.
+ */
+#ifdef __KERNEL__
+const struct skel_kernels *skel_kernels_begin(const struct skel_kernels *k);
+void skel_kernels_end(const struct skel_kernels *k);
+#else
+static inline const struct skel_kernels *
+skel_kernels_begin(const struct skel_kernels *k)
+{
+	return k;
+}
+
+static inline void
+skel_kernels_end(const struct skel_kernels *k __maybe_unused)
+{
+}
+#endif
+
+/* calibration */
+void skel_update_recip(const unsigned short *sigma_frame,
+		       unsigned int *recip_frame);
+void skel_calibrate_finish(const u32 *calib_sum, const u32 *calib_sumsq,
+			   unsigned char *average_frame,
+			   unsigned short *sigma_frame,
+			   unsigned short *average_q8,
+			   unsigned short *sigma_q8, unsigned int n);
+void skel_track_baseline(const unsigned char *current_frame,
+			 unsigned char *average_frame,
+			 unsigned short *sigma_frame,
+			 unsigned int *recip_frame,
+			 unsigned short *average_q8,
+			 unsigned short *sigma_q8, int ty, u64 skip,
+			 const struct skel_pipeline_options *options);
+
+/* region of interest */
+void skel_roi_update_gates(const unsigned short *sigma_frame,
+			   struct skel_roi *roi, int ty,
+			   const struct skel_pipeline_options *options);
+u64 skel_roi_dilate(u64 tiles);
+u64 skel_roi_select(const unsigned char *current_frame,
+		    const unsigned char *average_frame,
+		    unsigned short *score_frame,
+		    unsigned short *score_frame_adjacent,
+		    struct skel_roi *roi,
+		    const struct skel_pipeline_options *options);
+
+/* scoring */
+void skel_score_tiles(const struct skel_kernels *kernels,
+		      const unsigned char *current_frame,
+		      const unsigned char *average_frame,
+		      const unsigned int *recip_frame,
+		      unsigned short *score_frame, u64 tiles,
+		      const struct skel_pipeline_options *options);
+u64 skel_filter_tiles(const unsigned short *score_frame,
+		      unsigned short *score_frame_adjacent,
+		      const unsigned short *score_last_frame_adjacent,
+		      unsigned short *scratch,
+		      unsigned short threshold, u64 tiles,
+		      struct skel_score_summary *summary);
+
+/* contacts */
+int skel_label_contacts(const unsigned short *score_frame_adjacent,
+			unsigned short threshold,
+			struct blob_label *labels,
+			struct touch_contact *contacts, int max_contacts);
+void skel_position_contacts(const unsigned short *score_frame_adjacent,
+			    struct touch_contact *contacts, int count,
+			    bool fit);
+
+int normalize(unsigned char *current_frame,
+	      unsigned short *score_frame,
+	      unsigned short *score_frame_adjacent,
+	      unsigned short *score_last_frame_adjacent,
+	      unsigned char *average_frame,
+	      unsigned short *sigma_frame,
+	      unsigned int *recip_frame,
+	      u32 *calib_sum,
+	      u32 *calib_sumsq,
+	      unsigned short *box_scratch,
+	      const struct skel_kernels *kernels,
+	      int frame_index,
+	      bool calibrated,
+	      const struct skel_pipeline_options *options,
+	      unsigned short *average_q8,
+	      unsigned short *sigma_q8,
+	      struct skel_roi *roi,
+	      struct blob_label *labels,
+	      struct touch_contact *touch_contacts,
+	      struct skel_score_summary *summary,
+	      u64 *scored_at);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * GreenTouch scoring kernels, vector flavour
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * These are the reference loops of usbskeleton_pipeline.c, written so that GCC
+ * can vectorise them: fixed element types, no branches and no carried
+ * dependencies. Like arch/arm/lib/xor-neon.c, this file is built with
+ * -ftree-vectorize and the instruction set flags of the target (SSE2,
+ * AVX2 through usbskeleton_avx2.c, or NEON), so the compiler emits the
+ * vector code and callers own the FPU context.
+ */
+
+#include "usbskeleton_simd.h"
+
+#ifndef SKEL_SIMD_ISA
+#ifdef CONFIG_X86
+#define SKEL_SIMD_ISA sse2
+#else
+#define SKEL_SIMD_ISA neon
+#endif
+#endif
+
+#define __SKEL_SIMD_NAME(fn, isa)	fn##_##isa
+#define _SKEL_SIMD_NAME(fn, isa)	__SKEL_SIMD_NAME(fn, isa)
+#define SKEL_SIMD_NAME(fn)		_SKEL_SIMD_NAME(fn, SKEL_SIMD_ISA)
+
+void SKEL_SIMD_NAME(skel_accumulate)(const u8 *frame, u32 *sum, u32 *sumsq,
+				     unsigned int n)
+{
+	unsigned int k;
+	u32 f;
+
+	for (k = 0; k < n; k++) {
+		f = frame[k];
+		sum[k] += f;
+		sumsq[k] += f * f;
+	}
+}
+
+void SKEL_SIMD_NAME(skel_score)(const u8 *frame, const u8 *average,
+				const u32 *recip, u16 *score, unsigned int n)
+{
+	unsigned int k;
+	int d;
+
+	for (k = 0; k < n; k++) {
+		d = (int)frame[k] - (int)average[k];
+		score[k] = ((u32)(d < 0 ? -d : d) * recip[k]) >> 16;
+	}
+}
@@ -0,0 +1,40 @@
+/*
+ * Vectorised per-cell kernels of the GreenTouch scoring pipeline.
+ *
+ * Every kernel has a scalar twin in usbskeleton_pipeline.c and must
+ * produce the same result bit for bit. The vector variants are built from
+ * usbskeleton_simd.c with per-object flags (see the Makefile) and may only
+ * be called between kernel_fpu_begin()/kernel_fpu_end() or
+ * kernel_neon_begin()/kernel_neon_end() in the kernel.
+ */
+
+#ifndef _USBSKELETON_SIMD_H
+#define _USBSKELETON_SIMD_H
+
+#include "usbskeleton_compat.h"
+
+/* a set of kernels the scoring stages call through */
+struct skel_kernels {
+	const char *name;
+	bool simd;	/* needs the FPU/NEON context */
+
+	/* sum[k] += frame[k], sumsq[k] += frame[k]^2 */
+	void (*accumulate)(const u8 *frame, u32 *sum, u32 *sumsq,
+			   unsigned int n);
+	/* score[k] = |frame[k] - average[k]| * recip[k] >> 16 */
+	void (*score)(const u8 *frame, const u8 *average, const u32 *recip,
+		      u16 *score, unsigned int n);
+};
+
+#define SKEL_SIMD_KERNELS(isa)						\
+	void skel_accumulate_##isa(const u8 *frame, u32 *sum,		\
+				   u32 *sumsq, unsigned int n);		\
+	void skel_score_##isa(const u8 *frame, const u8 *average,	\
+			      const u32 *recip, u16 *score,		\
+			      unsigned int n)
+
+SKEL_SIMD_KERNELS(sse2);
+SKEL_SIMD_KERNELS(avx2);
+SKEL_SIMD_KERNELS(neon);
+
+#endif
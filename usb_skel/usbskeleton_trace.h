@@ -0,0 +1,133 @@
+/*
+ * Tracepoints of the GreenTouch foil driver
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation, version 2.
+ *
+ * Enable them with
+ *	echo 1 > /sys/kernel/debug/tracing/events/greentouch/enable
+ * they cost a patched out branch when disabled, and nothing at all
+ * without CONFIG_TRACEPOINTS.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM greentouch
+
+#if !defined(_USBSKELETON_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _USBSKELETON_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(greentouch_frame,
+	TP_PROTO(int frame_index, bool scored, int contacts),
+	TP_ARGS(frame_index, scored, contacts),
+
+	TP_STRUCT__entry(
+		__field(int, frame_index)
+		__field(bool, scored)
+		__field(int, contacts)
+	),
+
+	TP_fast_assign(
+		__entry->frame_index = frame_index;
+		__entry->scored = scored;
+		__entry->contacts = contacts;
+	),
+
+	TP_printk("frame=%d scored=%d contacts=%d",
+		  __entry->frame_index, __entry->scored, __entry->contacts)
+);
+
+TRACE_EVENT(greentouch_contact,
+	TP_PROTO(int id, int x, int y, int w, int h),
+	TP_ARGS(id, x, y, w, h),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, x)
+		__field(int, y)
+		__field(int, w)
+		__field(int, h)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->x = x;
+		__entry->y = y;
+		__entry->w = w;
+		__entry->h = h;
+	),
+
+	TP_printk("contact=%d x=%d y=%d w=%d h=%d",
+		  __entry->id, __entry->x, __entry->y, __entry->w, __entry->h)
+);
+
+TRACE_EVENT(greentouch_latency,
+	TP_PROTO(int frame_index, u64 queue_ns, u64 score_ns, u64 label_ns,
+		 u64 report_ns),
+	TP_ARGS(frame_index, queue_ns, score_ns, label_ns, report_ns),
+
+	TP_STRUCT__entry(
+		__field(int, frame_index)
+		__field(u64, queue_ns)
+		__field(u64, score_ns)
+		__field(u64, label_ns)
+		__field(u64, report_ns)
+	),
+
+	TP_fast_assign(
+		__entry->frame_index = frame_index;
+		__entry->queue_ns = queue_ns;
+		__entry->score_ns = score_ns;
+		__entry->label_ns = label_ns;
+		__entry->report_ns = report_ns;
+	),
+
+	TP_printk("frame=%d queue=%lluns score=%lluns label=%lluns report=%lluns",
+		  __entry->frame_index, __entry->queue_ns, __entry->score_ns,
+		  __entry->label_ns, __entry->report_ns)
+);
+
+TRACE_EVENT(greentouch_calibration,
+	TP_PROTO(int frame_index, const char *phase),
+	TP_ARGS(frame_index, phase),
+
+	TP_STRUCT__entry(
+		__field(int, frame_index)
+		__string(phase, phase)
+	),
+
+	TP_fast_assign(
+		__entry->frame_index = frame_index;
+		__assign_str(phase, phase);
+	),
+
+	TP_printk("frame=%d %s", __entry->frame_index, __get_str(phase))
+);
+
+TRACE_EVENT(greentouch_idle,
+	TP_PROTO(int frame_index, bool idle),
+	TP_ARGS(frame_index, idle),
+
+	TP_STRUCT__entry(
+		__field(int, frame_index)
+		__field(bool, idle)
+	),
+
+	TP_fast_assign(
+		__entry->frame_index = frame_index;
+		__entry->idle = idle;
+	),
+
+	TP_printk("frame=%d idle=%d", __entry->frame_index, __entry->idle)
+);
+
+#endif /* _USBSKELETON_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbskeleton_trace
+#include <trace/define_trace.h>